@@ -42,6 +42,9 @@
 #define SFEX_VERSION 1
 #define SFEX_REVISION 3
 
+/* version number of the binary on-disk format, see sfex_controldata_ondisk_v2 */
+#define SFEX_VERSION_V2 2
+
 #if 0
 #ifndef TRUE
 #  define TRUE 1
@@ -63,6 +66,9 @@
  */
 #define SFEX_ODIRECT_ALIGNMENT sysconf(_SC_PAGESIZE)
 
+/* block size used when the meta-data is stored in a regular file */
+#define SFEX_FILE_BLOCKSIZE 512
+
 /*
  * sfex_controldata --- control data
  *
@@ -143,8 +149,10 @@ typedef struct sfex_controldata_ondisk {
  */
 typedef struct sfex_lockdata {
   char status;				/* status of lock */
-  int count;				/* increment counter */
+  uint64_t count;			/* increment counter (generation in version 2) */
   char nodename[256];		/* node name */
+  uint64_t timestamp;		/* last update, msec since the Epoch (version 2 only) */
+  char request[256];		/* node waiting for a handoff (version 2 only) */
 } sfex_lockdata;
 
 typedef struct sfex_lockdata_ondisk {
@@ -153,6 +161,59 @@ typedef struct sfex_lockdata_ondisk {
 	uint8_t nodename[256];
 } sfex_lockdata_ondisk;
 
+/*
+ * on-disk format version 2
+ *
+ * Version 1 stores numbers as printable strings and its counter wraps at
+ * SFEX_MAX_COUNT, so a reader missing exactly 1000 updates sees the same 
+ * count. Version 2 stores little-endian fixed width integers and protects 
+ * every block with a CRC32C. Both versions start with the same magic number 
+ * and the version field tells them apart: printable digits in version 1, 
+ * a binary 2 in version 2.
+ *
+ * control data: magic number, version and revision (4 bytes each), crc (4 
+ * bytes), blocksize (8 bytes) and number of locks (4 bytes).
+ *
+ * lock data: status (1 byte, same characters as version 1), 3 reserved 
+ * bytes, crc (4 bytes), generation (8 bytes), timestamp (8 bytes), node 
+ * name (240 bytes, null terminated) and request (240 bytes, null 
+ * terminated).
+ *
+ * generation --- 64-bit counter incremented by every update of the lock 
+ * data. It does not wrap.
+ *
+ * timestamp --- time of the last update in milliseconds since the Epoch, 
+ * for information only. Lock validity never depends on synchronized clocks.
+ *
+ * request --- node name of a node waiting for the lock, empty if none. A 
+ * holder that releases the lock keeps the name there: the lock is then 
+ * handed off to that node, and other nodes treat it as held. Blocks 
+ * written before this field existed have it zeroed.
+ *
+ * crc --- CRC32C (Castagnoli) of the whole block, computed with the crc 
+ * field set to zero.
+ *
+ * The rest of the block up to blocksize is padding filled with 0x00.
+ */
+typedef struct sfex_controldata_ondisk_v2 {
+  uint8_t magic[4];
+  uint8_t version[4];
+  uint8_t revision[4];
+  uint8_t crc[4];
+  uint8_t blocksize[8];
+  uint8_t numlocks[4];
+} sfex_controldata_ondisk_v2;
+
+typedef struct sfex_lockdata_ondisk_v2 {
+  uint8_t status;
+  uint8_t reserved[3];
+  uint8_t crc[4];
+  uint8_t generation[8];
+  uint8_t timestamp[8];
+  uint8_t nodename[240];
+  uint8_t request[240];
+} sfex_lockdata_ondisk_v2;
+
 /* character for lock status. This is used in sfex_lockdata.status */
 #define SFEX_STATUS_UNLOCK 'u' /* unlock */
 #define SFEX_STATUS_LOCK 'l'	/* lock */
@@ -164,8 +225,9 @@ typedef struct sfex_lockdata_ondisk {
 #define SFEX_MIN_COUNT 0
 #define SFEX_MAX_COUNT 999
 #define SFEX_MAX_NODENAME (sizeof(((sfex_lockdata *)0)->nodename) - 1)
+#define SFEX_MAX_NODENAME_V2 (sizeof(((sfex_lockdata_ondisk_v2 *)0)->nodename) - 1)
 
-/* update macro for increment counter */
+/* update macro for increment counter (version 1), see next_lockcount() */
 #define SFEX_NEXT_COUNT(c) (c >= SFEX_MAX_COUNT ? c - SFEX_MAX_COUNT : c + 1)
 
 /* extern variables */
@@ -12,6 +12,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/watchdog.h>
 #include "sfex.h"
 #include "sfex_lib.h"
 
@@ -20,48 +27,776 @@
 #endif
 
 static int sysrq_fd;
-static int lock_index = 1;        /* default 1st lock */
-static time_t collision_timeout = 1; /* default 1 sec */
-static time_t lock_timeout = 60; /* default 60 sec */
+static int lock_indexes[SFEX_MAX_NUMLOCKS] = { 1 };        /* default 1st lock */
+static int num_indexes = 1;
+/* timeouts and interval are kept in milliseconds */
+static long collision_timeout = 1000; /* default 1 sec */
+static long lock_timeout = 60000; /* default 60 sec */
 time_t unlock_timeout = 60;
-static time_t monitor_interval = 10;
+static long monitor_interval = 10000;
+static long latency_warning = 0;	/* ms, 0 disables the warning */
+static int early_release = 0;	/* percent of lock_timeout, 0 disables */
+static const char *status_path;
+static const char *watchdog_path;
 
 static sfex_controldata cdata;
-static sfex_lockdata ldata;
-static sfex_lockdata ldata_new;
+/* lock data of lock_indexes[i] is kept in ldata[i] */
+static sfex_lockdata ldata[SFEX_MAX_NUMLOCKS];
+static sfex_lockdata ldata_new[SFEX_MAX_NUMLOCKS];
 
-static const char *device;
+/* Renewal I/O runs in io_thread, so a hung disk cannot keep the main
+   thread from fencing. The main thread waits for each renewal only until
+   renew_deadline, which is taken from the last successful write. */
+static pthread_t io_thread;
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond;
+static int io_requested, io_done, io_result;
+static struct timespec last_write;	/* when the last renewal write was issued */
+
+enum {
+	RENEW_OK = 0,
+	RENEW_READ_FAILED,
+	RENEW_LOST,
+	RENEW_WRITE_FAILED,
+};
+
+/* Renewal latency, measured from the request to the end of its write.
+   Kept by the main thread and read by the status thread. */
+#define RENEW_LATENCY_BUCKETS 10
+static const long renew_latency_bounds[RENEW_LATENCY_BUCKETS] = {
+	1, 5, 10, 50, 100, 500, 1000, 5000, 10000, 30000
+};
+static struct {
+	unsigned long count;
+	/* the last bucket counts renewals above every bound */
+	unsigned long buckets[RENEW_LATENCY_BUCKETS + 1];
+	unsigned long long sum_ms;
+	long last_ms;
+	long max_ms;
+	unsigned long warnings;
+	/* the end of the last successful renewal, or of the acquisition */
+	struct timespec last_ok;	/* CLOCK_MONOTONIC */
+	struct timespec last_ok_wall;	/* CLOCK_REALTIME */
+	char request[256];	/* a node waiting for a handoff, if any */
+} renew_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t status_thread;
+static int status_fd = -1;
+
+/* The watchdog is armed once the lock is held and petted after successful
+   renewals only, so the node is reset in time even if the daemon hangs,
+   is stopped or gets killed. */
+static int watchdog_fd = -1;
+static int watchdog_timeout;	/* seconds */
+
+/*
+ * The lock area may be replicated on 3 or 5 devices. Each device has a
+ * worker thread, so requests go out in parallel and a hung device does
+ * not hold the others up. A request completes once a majority of the
+ * devices answered. A device still busy gets the new request queued in
+ * place of any older one it has not started, so a hung device does not
+ * pile requests up.
+ * Generations never wrap in version 2 meta-data, so the newest copy of a
+ * lock is the one with the highest count, and every majority read sees
+ * the last majority write. A write that reached only a minority, such as
+ * an acquisition that lost a collision, may carry the same count as the
+ * majority one, so a copy found on a majority of the devices comes first.
+ */
+#define SFEX_MAX_REPLICAS 5
+enum {
+	REPLICA_IDLE = 0,
+	REPLICA_READ,
+	REPLICA_WRITE,
+};
+static struct replica {
+	const char *path;
+	sfex_device *dev;	/* NULL if the device could not be opened */
+	pthread_t thread;
+	int pending;		/* request not yet started by the worker */
+	unsigned long pending_round;
+	sfex_lockdata *request;	/* lock data to write for the pending request */
+	int ok;			/* result of the last finished request */
+	unsigned long done_round;	/* request the result belongs to */
+	sfex_lockdata *ldata;	/* num_indexes lock data for the worker */
+	sfex_lockdata *result;	/* copy of ldata from the last read */
+} replicas[SFEX_MAX_REPLICAS];
+static int num_replicas;
+static unsigned long replica_round;
+
+/* A single device that supports SCSI COMPARE AND WRITE has its locks
+   taken and renewed atomically. caw_raw keeps each lock block as last
+   read or written, which is what the next command compares with. */
+static int use_caw;
+static uint8_t *caw_raw;
+static pthread_mutex_t replica_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replica_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t replica_done = PTHREAD_COND_INITIALIZER;
+
+static void release_lock(void);
+static void close_watchdog(void);
+static int renew_locks_caw(void);
+
+/* set by the SIGTERM handler, the lock is released from the main loop */
+static volatile sig_atomic_t quit_requested;
 const char *progname;
 char *nodename;
 static const char *rsc_id = "sfex";
 
 static void usage(FILE *dist) {
-	  fprintf(dist, "usage: %s [-i <index>] [-c <collision_timeout>] [-t <lock_timeout>] <device>\n", progname);
+	  fprintf(dist, "usage: %s [-i <index>[,<index>|,<first>-<last>]...] [-c <collision_timeout>] [-t <lock_timeout>] [-m <monitor_interval>] [-l <latency_warning>] [-e <percent>] [-s <status_socket>] [-w <watchdog_device>] <device> [<device> <device> [<device> <device>]]\n", progname);
+	  fprintf(dist, "  with 3 or 5 devices a lock is held on a majority of them (version 2 meta-data only)\n");
+	  fprintf(dist, "  timeouts, interval and latency_warning are in seconds, or in milliseconds with a \"ms\" suffix\n");
+	  fprintf(dist, "  -e gives the lock up early when a renewal takes more than <percent> of lock_timeout\n");
+	  fprintf(dist, "  -w resets the node through the watchdog when the lock is not renewed in time\n");
+}
+
+/*
+ * parse_msec --- parse "<n>", "<n>s" or "<n>ms" into milliseconds
+ */
+static int parse_msec(const char *arg, long *ms)
+{
+	char *end;
+	unsigned long l = strtoul(arg, &end, 10);
+
+	if (end == arg)
+		return -1;
+	if (!strcmp(end, "ms")) {
+		if (l < 1 || l > INT_MAX)
+			return -1;
+		*ms = l;
+	} else if (*end == '\0' || !strcmp(end, "s")) {
+		if (l < 1 || l > INT_MAX / 1000)
+			return -1;
+		*ms = l * 1000;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static void timespec_add_ms(struct timespec *ts, long ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static long ms_between(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000
+		+ (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/* Sleep until an absolute CLOCK_MONOTONIC deadline, so waits do not drift */
+static void sleep_until(const struct timespec *deadline)
+{
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR)
+		;
+}
+
+static void sleep_ms(long ms)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	timespec_add_ms(&deadline, ms);
+	sleep_until(&deadline);
+}
+
+/* The locks we hold are renewed together. Adjacent indexes are read and
+   written as one range, so a run of locks costs a single request. */
+static int read_device_locks(sfex_device *dev, sfex_lockdata *buf)
+{
+	int i = 0;
+
+	while (i < num_indexes) {
+		int n = 1;
+		while (i + n < num_indexes && lock_indexes[i + n] == lock_indexes[i] + n)
+			n++;
+		if (read_device_lockdata_range(dev, &cdata, &buf[i], lock_indexes[i], n) == -1)
+			return -1;
+		i += n;
+	}
+	return 0;
+}
+
+static int write_device_locks(sfex_device *dev, const sfex_lockdata *buf)
+{
+	int i = 0;
+
+	while (i < num_indexes) {
+		int n = 1;
+		while (i + n < num_indexes && lock_indexes[i + n] == lock_indexes[i] + n)
+			n++;
+		if (write_device_lockdata_range(dev, &cdata, &buf[i], lock_indexes[i], n) == -1)
+			return -1;
+		i += n;
+	}
+	return 0;
+}
+
+static void *replica_main(void *arg)
+{
+	struct replica *r = arg;
+
+	pthread_mutex_lock(&replica_lock);
+	while (1) {
+		unsigned long round;
+		int op, rc;
+
+		while (r->pending == REPLICA_IDLE)
+			pthread_cond_wait(&replica_work, &replica_lock);
+		op = r->pending;
+		round = r->pending_round;
+		if (op == REPLICA_WRITE)
+			memcpy(r->ldata, r->request, sizeof(*r->ldata) * num_indexes);
+		r->pending = REPLICA_IDLE;
+		pthread_mutex_unlock(&replica_lock);
+
+		if (op == REPLICA_READ)
+			rc = read_device_locks(r->dev, r->ldata);
+		else
+			rc = write_device_locks(r->dev, r->ldata);
+
+		pthread_mutex_lock(&replica_lock);
+		if (rc == -1)
+			cl_log(LOG_ERR, "%s of %s failed\n",
+					op == REPLICA_READ ? "read" : "write", r->path);
+		else if (op == REPLICA_READ)
+			memcpy(r->result, r->ldata, sizeof(*r->ldata) * num_indexes);
+		r->ok = rc == 0;
+		r->done_round = round;
+		pthread_cond_broadcast(&replica_done);
+	}
+	return NULL;
+}
+
+static void start_replica_threads(void)
+{
+	sigset_t all, old;
+	int i, rc;
+
+	/* signals are handled by the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < num_replicas; i++) {
+		struct replica *r = &replicas[i];
+
+		if (!r->dev)
+			continue;
+		r->ldata = calloc(num_indexes, sizeof(*r->ldata));
+		r->request = calloc(num_indexes, sizeof(*r->request));
+		r->result = calloc(num_indexes, sizeof(*r->result));
+		if (!r->ldata || !r->request || !r->result) {
+			cl_log(LOG_ERR, "%s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		rc = pthread_create(&r->thread, NULL, replica_main, r);
+		if (rc != 0) {
+			cl_log(LOG_ERR, "can't start the I/O thread of %s: %s\n", r->path, strerror(rc));
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Hand op to every device and wait for a majority of answers.
+   Returns the number of devices that succeeded in this round. */
+static int replica_io(int op, const sfex_lockdata *buf)
+{
+	int i, dispatched = 0, ok, failed;
+
+	pthread_mutex_lock(&replica_lock);
+	replica_round++;
+	for (i = 0; i < num_replicas; i++) {
+		struct replica *r = &replicas[i];
+
+		if (!r->dev)
+			continue;
+		if (op == REPLICA_WRITE)
+			memcpy(r->request, buf, sizeof(*buf) * num_indexes);
+		r->pending = op;
+		r->pending_round = replica_round;
+		dispatched++;
+	}
+	pthread_cond_broadcast(&replica_work);
+	while (1) {
+		ok = failed = 0;
+		for (i = 0; i < num_replicas; i++) {
+			struct replica *r = &replicas[i];
+
+			if (r->dev && r->done_round == replica_round) {
+				if (r->ok)
+					ok++;
+				else
+					failed++;
+			}
+		}
+		if (ok > num_replicas / 2 || ok + failed == dispatched)
+			break;
+		pthread_cond_wait(&replica_done, &replica_lock);
+	}
+	pthread_mutex_unlock(&replica_lock);
+	return ok;
+}
+
+/* Loop over the devices that answered the last read. The caller holds
+   replica_lock, as a slow device may still finish it meanwhile. */
+#define FOR_EACH_RESULT(r) \
+	for ((r) = replicas; (r) < replicas + num_replicas; (r)++) \
+		if ((r)->dev && (r)->done_round == replica_round && (r)->ok)
+
+/* whether two copies of a lock come from the same write */
+static int same_write(const sfex_lockdata *a, const sfex_lockdata *b)
+{
+	return a->count == b->count && a->status == b->status
+		&& !strncmp(a->nodename, b->nodename, sizeof(a->nodename));
+}
+
+/* Read each lock from a majority of the devices. The copy on a majority
+   of all devices wins, else the newest, else the one most devices agree
+   on. */
+static int read_locks(sfex_lockdata *buf)
+{
+	struct replica *r, *s;
+	int i, votes, best;
+
+	if (replica_io(REPLICA_READ, NULL) <= num_replicas / 2)
+		return -1;
+	pthread_mutex_lock(&replica_lock);
+	for (i = 0; i < num_indexes; i++) {
+		best = 0;
+		FOR_EACH_RESULT(r) {
+			const sfex_lockdata *l = &r->result[i];
+
+			votes = 0;
+			FOR_EACH_RESULT(s)
+				if (same_write(&s->result[i], l))
+					votes++;
+			if (best && (best > num_replicas / 2
+					|| (votes <= num_replicas / 2
+						&& (l->count < buf[i].count
+							|| (l->count == buf[i].count && votes <= best)))))
+				continue;
+			buf[i] = *l;
+			best = votes;
+		}
+	}
+	pthread_mutex_unlock(&replica_lock);
+	return 0;
+}
+
+static int write_locks(const sfex_lockdata *buf)
+{
+	return replica_io(REPLICA_WRITE, buf) > num_replicas / 2 ? 0 : -1;
+}
+
+static int held_by_own_node(const sfex_lockdata *l)
+{
+	return l->status == SFEX_STATUS_LOCK
+		&& !strncmp((const char*)(l->nodename), nodename, sizeof(l->nodename));
+}
+
+/* whether a majority of the devices of the last read show lock i as ours */
+static int own_on_majority(int i)
+{
+	struct replica *r;
+	int own = 0;
+
+	pthread_mutex_lock(&replica_lock);
+	FOR_EACH_RESULT(r)
+		if (held_by_own_node(&r->result[i]))
+			own++;
+	pthread_mutex_unlock(&replica_lock);
+	return own > num_replicas / 2;
+}
+
+/* Give back the locks written during a failed acquisition */
+static void abandon_locks(void)
+{
+	int i, own = 0;
+
+	if (read_locks(ldata_new) == -1)
+		return;
+	for (i = 0; i < num_indexes; i++) {
+		if (held_by_own_node(&ldata_new[i])) {
+			ldata_new[i].status = SFEX_STATUS_UNLOCK;
+			if (num_replicas > 1)
+				ldata_new[i].count = next_lockcount(&cdata, ldata_new[i].count);
+			own++;
+		}
+	}
+	if (own && write_locks(ldata_new) == -1)
+		cl_log(LOG_ERR, "write_lockdata failed while abandoning locks\n");
+}
+
+/*
+ * Handoff (version 2 meta-data only). A node waiting for a lock held by
+ * another node puts its name into the empty request field of the lock.
+ * The holder keeps the request in its renewals, and when it is stopped it
+ * releases the lock with the request still there: the lock is handed off
+ * to the waiting node, which takes it at its next poll, and the other
+ * nodes treat it as held.
+ * A waiting node gives up after lock_timeout, so the holder drops a
+ * request it has seen for longer than that.
+ */
+enum {
+	LOCK_FREE = 0,
+	LOCK_HELD,	/* by another node, or handed off to one */
+	LOCK_HANDED,	/* handed off to own node */
+};
+
+static int lock_state(const sfex_lockdata *l)
+{
+	if (l->status == SFEX_STATUS_LOCK)
+		return held_by_own_node(l) ? LOCK_FREE : LOCK_HELD;
+	if (!l->request[0])
+		return LOCK_FREE;
+	return strcmp(l->request, nodename) ? LOCK_HELD : LOCK_HANDED;
+}
+
+/* when the holder first saw the request of each lock, used by io_thread
+   and by release_lock() once renewals have stopped */
+static struct {
+	char name[256];
+	struct timespec since;
+} requests_seen[SFEX_MAX_NUMLOCKS];
+
+/* whether lock i has a live request, a stale one is removed from l */
+static int check_request(sfex_lockdata *l, int i)
+{
+	struct timespec now;
+
+	if (!l->request[0]) {
+		requests_seen[i].name[0] = 0;
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (strcmp(requests_seen[i].name, l->request)) {
+		snprintf(requests_seen[i].name, sizeof(requests_seen[i].name), "%s", l->request);
+		requests_seen[i].since = now;
+		cl_log(LOG_INFO, "node %s asks for lock #%d.\n", l->request, lock_indexes[i]);
+		return 1;
+	}
+	if (ms_between(&requests_seen[i].since, &now) < lock_timeout)
+		return 1;
+	cl_log(LOG_INFO, "request of node %s for lock #%d expired.\n", l->request, lock_indexes[i]);
+	l->request[0] = 0;
+	requests_seen[i].name[0] = 0;
+	return 0;
+}
+
+/* whether l is still the lock prev was read as, held by the same node */
+static int same_holder_write(const sfex_lockdata *prev, const sfex_lockdata *l)
+{
+	return l->count == prev->count && l->status == SFEX_STATUS_LOCK
+		&& !strncmp(l->nodename, prev->nodename, sizeof(l->nodename));
+}
+
+/* Ask for the locks when every one is held by another node and nobody
+   has asked yet. Returns 1 if the request was written. */
+static int post_request(void)
+{
+	int i;
+
+	for (i = 0; i < num_indexes; i++)
+		if (ldata[i].status != SFEX_STATUS_LOCK || held_by_own_node(&ldata[i])
+				|| ldata[i].request[0])
+			return 0;
+	if (use_caw) {
+		/* never overwrite an update the holder made after the last read */
+		for (i = 0; i < num_indexes; i++) {
+			uint8_t *raw = caw_raw + cdata.blocksize * i;
+			sfex_lockdata cur, new;
+
+			if (read_device_lockblock(replicas[0].dev, &cdata, &cur, lock_indexes[i], raw) == -1
+					|| !same_holder_write(&ldata[i], &cur))
+				return 0;
+			new = cur;
+			strncpy(new.request, nodename, sizeof(new.request) - 1);
+			new.count = next_lockcount(&cdata, cur.count);
+			if (compare_and_write_lockdata(replicas[0].dev, &cdata,
+						&new, lock_indexes[i], raw) != 0)
+				return 0;
+			ldata[i] = new;
+		}
+		return 1;
+	}
+	/* The request is written with the whole lock, so a release or renewal
+	   of the holder since the last read would be undone. Read again right
+	   before the write, which leaves only the time of one write for that. */
+	if (read_locks(ldata_new) == -1)
+		return 0;
+	for (i = 0; i < num_indexes; i++) {
+		if (!same_holder_write(&ldata[i], &ldata_new[i]) || ldata_new[i].request[0])
+			return 0;
+		strncpy(ldata_new[i].request, nodename, sizeof(ldata_new[i].request) - 1);
+		ldata_new[i].count = next_lockcount(&cdata, ldata_new[i].count);
+	}
+	if (write_locks(ldata_new) == -1) {
+		cl_log(LOG_ERR, "write_lockdata failed while requesting a handoff\n");
+		return 0;
+	}
+	memcpy(ldata, ldata_new, sizeof(ldata[0]) * num_indexes);
+	return 1;
+}
+
+/* whether cur shows a write of the holder since prev was read; a waiting
+   node only ever fills in an empty request field */
+static int updated_by_holder(const sfex_lockdata *prev, const sfex_lockdata *cur)
+{
+	if (cur->count == prev->count)
+		return 0;
+	return prev->request[0] || !cur->request[0];
+}
+
+/* report the first live request on the status socket */
+static void publish_request(void)
+{
+	const char *request = "";
+	int i;
+
+	for (i = 0; i < num_indexes; i++)
+		if (ldata[i].request[0]) {
+			request = ldata[i].request;
+			break;
+		}
+	pthread_mutex_lock(&stats_lock);
+	snprintf(renew_stats.request, sizeof(renew_stats.request), "%s", request);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * wait_for_handoff --- wait for locks held by other nodes (version 2)
+ *
+ * As with version 1, a holder that does not update its lock for 
+ * lock_timeout is taken for dead. The lock data is polled every 
+ * monitor_interval meanwhile, so a lock that is released or handed off 
+ * is taken without waiting any longer. Returns the number of locks 
+ * handed off to own node, exits if a holder is alive.
+ */
+static int wait_for_handoff(void)
+{
+	struct timespec next, end;
+	int i, held, handed, active = 0, requested;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	end = next;
+	timespec_add_ms(&end, lock_timeout);
+	requested = post_request();
+	while (1) {
+		timespec_add_ms(&next, monitor_interval);
+		if (ms_between(&end, &next) > 0)
+			next = end;
+		sleep_until(&next);
+		if (quit_requested) {
+			cl_log(LOG_INFO, "stopped while waiting for the lock.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (read_locks(ldata_new) == -1) {
+			cl_log(LOG_ERR, "read_lockdata failed in acquire_lock\n");
+			exit(EXIT_FAILURE);
+		}
+		held = handed = 0;
+		for (i = 0; i < num_indexes; i++) {
+			int state = lock_state(&ldata_new[i]);
+
+			if (state == LOCK_HELD)
+				held++;
+			else if (state == LOCK_HANDED)
+				handed++;
+			if (updated_by_holder(&ldata[i], &ldata_new[i]))
+				active = 1;
+		}
+		memcpy(ldata, ldata_new, sizeof(ldata[0]) * num_indexes);
+		if (!held)
+			return handed;
+		if (ms_between(&end, &next) >= 0)
+			break;
+		/* a renewal that read the lock before the request was written
+		   drops it again, so it is posted again whenever it is gone */
+		if (post_request()) {
+			if (requested)
+				cl_log(LOG_INFO, "handoff request was overwritten, asking again.\n");
+			requested = 1;
+		}
+	}
+	if (active) {
+		cl_log(LOG_ERR, "can\'t acquire lock: the lock's already hold by some other node.\n");
+		exit(2);
+	}
+	return handed;
+}
+
+/* parse "<index>[,<index>|,<first>-<last>]..." into sorted lock_indexes */
+static int parse_indexes(const char *arg)
+{
+	static char seen[SFEX_MAX_NUMLOCKS + 1];
+	char *list, *tok, *save = NULL;
+	int i;
+
+	memset(seen, 0, sizeof(seen));
+	list = strdup(arg);
+	if (!list)
+		return -1;
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char *end;
+		unsigned long first, last;
+
+		first = strtoul(tok, &end, 10);
+		last = first;
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+		if (*end != '\0' || first < SFEX_MIN_NUMLOCKS || last > SFEX_MAX_NUMLOCKS || first > last) {
+			free(list);
+			return -1;
+		}
+		for (; first <= last; first++)
+			seen[first] = 1;
+	}
+	free(list);
+
+	num_indexes = 0;
+	for (i = SFEX_MIN_NUMLOCKS; i <= SFEX_MAX_NUMLOCKS; i++)
+		if (seen[i])
+			lock_indexes[num_indexes++] = i;
+	return num_indexes ? 0 : -1;
+}
+
+/* release the first n locks taken by acquire_locks_caw(), except those
+   another node has written over since */
+static void abandon_locks_caw(int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		sfex_lockdata l = ldata[i];
+
+		if (!held_by_own_node(&l))
+			continue;
+		l.status = SFEX_STATUS_UNLOCK;
+		if (compare_and_write_lockdata(replicas[0].dev, &cdata, &l, lock_indexes[i],
+					caw_raw + cdata.blocksize * i) != 0)
+			cl_log(LOG_ERR, "can't give lock #%d back.\n", lock_indexes[i]);
+	}
+}
+
+/*
+ * With COMPARE AND WRITE each lock is taken in one atomic command that
+ * only succeeds if the lock is still as the last read saw it. A lock
+ * changed since it was read means another node is active on it.
+ * Whether a node uses the command is decided by each node for itself,
+ * and a node writing plainly does not compare: it may overwrite the lock
+ * just taken, or have written its own just before. So the collision is
+ * still waited for, and the extension write, itself compared with the
+ * block written here, takes the lock only if nobody but a node asking
+ * for a handoff wrote it meanwhile.
+ */
+static void acquire_locks_caw(int handed)
+{
+	int i, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &last_write);
+	for (i = 0; i < num_indexes; i++) {
+		uint8_t *raw = caw_raw + cdata.blocksize * i;
+		sfex_lockdata cur, new;
+
+		if (read_device_lockblock(replicas[0].dev, &cdata, &cur, lock_indexes[i], raw) == -1) {
+			cl_log(LOG_ERR, "read_lockdata failed in acquire_lock\n");
+			abandon_locks_caw(i);
+			exit(EXIT_FAILURE);
+		}
+		if (cur.count != ldata[i].count || cur.status != ldata[i].status) {
+			cl_log(LOG_ERR, "can\'t acquire lock #%d: the lock's already hold by some other node.\n", lock_indexes[i]);
+			abandon_locks_caw(i);
+			exit(2);
+		}
+		new = cur;
+		new.status = SFEX_STATUS_LOCK;
+		new.count = next_lockcount(&cdata, cur.count);
+		strncpy(new.nodename, nodename, sizeof(new.nodename) - 1);
+		new.request[0] = 0;
+		ret = compare_and_write_lockdata(replicas[0].dev, &cdata, &new, lock_indexes[i], raw);
+		if (ret != 0) {
+			if (ret == 1)
+				cl_log(LOG_ERR, "can\'t acquire lock #%d: collision detected in the air.\n", lock_indexes[i]);
+			else
+				cl_log(LOG_ERR, "write_lockdata failed\n");
+			abandon_locks_caw(i);
+			exit(ret == 1 ? 2 : EXIT_FAILURE);
+		}
+		ldata[i] = new;
+	}
+
+	/* locks handed off to own node are not contended, as below */
+	if (handed < num_indexes)
+		sleep_ms(collision_timeout);
+	switch (renew_locks_caw()) {
+	case RENEW_OK:
+		break;
+	case RENEW_LOST:
+		cl_log(LOG_ERR, "can\'t acquire lock: collision detected in the air.\n");
+		abandon_locks_caw(num_indexes);
+		exit(2);
+	default:
+		cl_log(LOG_ERR, "write_lockdata failed in extension of lock\n");
+		abandon_locks_caw(num_indexes);
+		exit(EXIT_FAILURE);
+	}
 }
 
 static void acquire_lock(void)
 {
-	if (read_lockdata(&cdata, &ldata, lock_index) == -1) {
+	int i, held_by_others = 0, handed = 0;
+
+	if (read_locks(ldata) == -1) {
 		cl_log(LOG_ERR, "read_lockdata failed in acquire_lock\n");
 		exit(EXIT_FAILURE);
 	}
 
-	if ((ldata.status == SFEX_STATUS_LOCK) && (strncmp(nodename, (const char*)(ldata.nodename), sizeof(ldata.nodename)))) {
-		unsigned int t = lock_timeout;
-		while (t > 0)
-			t = sleep(t);
-		read_lockdata(&cdata, &ldata_new, lock_index);
-		if (ldata.count != ldata_new.count) {
-			cl_log(LOG_ERR, "can\'t acquire lock: the lock's already hold by some other node.\n");
-			exit(2);
+	for (i = 0; i < num_indexes; i++) {
+		int state = lock_state(&ldata[i]);
+
+		if (state == LOCK_HELD)
+			held_by_others = 1;
+		else if (state == LOCK_HANDED)
+			handed++;
+	}
+
+	if (held_by_others && cdata.version == SFEX_VERSION_V2) {
+		handed = wait_for_handoff();
+	} else if (held_by_others) {
+		sleep_ms(lock_timeout);
+		if (read_locks(ldata_new) == -1) {
+			cl_log(LOG_ERR, "read_lockdata failed in acquire_lock\n");
+			exit(EXIT_FAILURE);
+		}
+		/* Any lock updated meanwhile means somebody else is active on it */
+		for (i = 0; i < num_indexes; i++) {
+			if (ldata[i].count != ldata_new[i].count) {
+				cl_log(LOG_ERR, "can\'t acquire lock #%d: the lock's already hold by some other node.\n", lock_indexes[i]);
+				exit(2);
+			}
 		}
 	}
 
+	if (use_caw) {
+		acquire_locks_caw(handed);
+		cl_log(LOG_INFO, "lock acquired\n");
+		return;
+	}
+
 	/* The lock acquisition is possible because it was not updated. */
-	ldata.status = SFEX_STATUS_LOCK;
-	ldata.count = SFEX_NEXT_COUNT(ldata.count);
-	strncpy((char*)(ldata.nodename), nodename, sizeof(ldata.nodename) - 1);
-	if (write_lockdata(&cdata, &ldata, lock_index) == -1) {
+	for (i = 0; i < num_indexes; i++) {
+		ldata[i].status = SFEX_STATUS_LOCK;
+		ldata[i].count = next_lockcount(&cdata, ldata[i].count);
+		strncpy((char*)(ldata[i].nodename), nodename, sizeof(ldata[i].nodename) - 1);
+		ldata[i].request[0] = 0;
+	}
+	if (write_locks(ldata) == -1) {
 		cl_log(LOG_ERR, "write_lockdata failed\n");
 		exit(EXIT_FAILURE);
 	}
@@ -72,25 +807,31 @@ static void acquire_lock(void)
 	   seconds to detect this,and whether the superscription of lock data by 
 	   another node is done is checked. If the superscription was done by 
 	   another node, the lock acquisition with the own node is given up.  
+	   Locks handed off to own node are not contended: every other node 
+	   treats them as held.
 	 */
-	{
-		unsigned int t = collision_timeout;
-		while (t > 0)
-			t = sleep(t);
-		if (read_lockdata(&cdata, &ldata_new, lock_index) == -1) {
+	if (handed < num_indexes) {
+		sleep_ms(collision_timeout);
+		if (read_locks(ldata_new) == -1) {
 			cl_log(LOG_ERR, "read_lockdata failed in collision detection\n");
 		}
-		if (strncmp((char*)(ldata.nodename), (const char*)(ldata_new.nodename), sizeof(ldata.nodename))) {
-			cl_log(LOG_ERR, "can\'t acquire lock: collision detected in the air.\n");
-			exit(2);
+		for (i = 0; i < num_indexes; i++) {
+			if (strncmp((char*)(ldata[i].nodename), (const char*)(ldata_new[i].nodename), sizeof(ldata[i].nodename))
+					|| !own_on_majority(i)) {
+				cl_log(LOG_ERR, "can\'t acquire lock #%d: collision detected in the air.\n", lock_indexes[i]);
+				abandon_locks();
+				exit(2);
+			}
 		}
 	}
 
 	/* extension of lock */
 	/* Validly time of the lock is extended. It is because of spending at 
 	   the collision_timeout seconds to detect the collision. */
-	ldata.count = SFEX_NEXT_COUNT(ldata.count);
-	if (write_lockdata(&cdata, &ldata, lock_index) == -1) {
+	for (i = 0; i < num_indexes; i++)
+		ldata[i].count = next_lockcount(&cdata, ldata[i].count);
+	clock_gettime(CLOCK_MONOTONIC, &last_write);
+	if (write_locks(ldata) == -1) {
 		cl_log(LOG_ERR, "write_lockdata failed in extension of lock\n");
 		exit(EXIT_FAILURE);
 	}
@@ -107,6 +848,186 @@ static void error_todo (void)
 	}
 }
 
+/* Ask the cluster to move the resource away; unlike error_todo() the
+   daemon keeps renewing until the stop action releases the lock. */
+static void request_failover(void)
+{
+	static int requested;
+	pid_t pid;
+
+	if (requested)
+		return;
+	requested = 1;
+	pid = fork();
+	if (pid == 0) {
+		cl_log(LOG_INFO, "Execute \"crm_resource -F -r %s --node %s\" command\n", rsc_id, nodename);
+		execl("/usr/sbin/crm_resource", "crm_resource", "-F", "-r", rsc_id, "--node", nodename, NULL);
+		_exit(EXIT_FAILURE);
+	} else if (pid == -1) {
+		cl_log(LOG_ERR, "fork failed: %s\n", strerror(errno));
+	}
+}
+
+/* the lock has just been written by an acquisition or a renewal */
+static void mark_renewed(void)
+{
+	pthread_mutex_lock(&stats_lock);
+	clock_gettime(CLOCK_MONOTONIC, &renew_stats.last_ok);
+	clock_gettime(CLOCK_REALTIME, &renew_stats.last_ok_wall);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void record_renewal(long ms)
+{
+	int b;
+
+	mark_renewed();
+	pthread_mutex_lock(&stats_lock);
+	for (b = 0; b < RENEW_LATENCY_BUCKETS; b++)
+		if (ms <= renew_latency_bounds[b])
+			break;
+	renew_stats.buckets[b]++;
+	renew_stats.count++;
+	renew_stats.sum_ms += ms;
+	renew_stats.last_ms = ms;
+	if (ms > renew_stats.max_ms)
+		renew_stats.max_ms = ms;
+	if (latency_warning && ms > latency_warning)
+		renew_stats.warnings++;
+	pthread_mutex_unlock(&stats_lock);
+
+	if (latency_warning && ms > latency_warning)
+		cl_log(LOG_WARNING, "lock renewal took %ld ms (lock_timeout is %ld ms).\n",
+				ms, lock_timeout);
+	if (early_release && ms * 100 > lock_timeout * early_release) {
+		cl_log(LOG_ERR, "lock renewal took %ld ms, more than %d%% of lock_timeout. giving the lock up.\n",
+				ms, early_release);
+		request_failover();
+	}
+}
+
+/*
+ * One "<name> <value>" line per item, the connection is closed after it.
+ * Everything comes from memory, so a query never touches the devices.
+ * The socket only exists while the lock is held; a renewal_age_ms above
+ * lock_timeout_ms means the renewals have stopped.
+ */
+static int format_status(char *buf, size_t len)
+{
+	struct timespec now;
+	size_t n = 0;
+	int b, i;
+
+#define STATUS_PRINTF(...) \
+	do { \
+		if (n < len) \
+			n += snprintf(buf + n, len - n, __VA_ARGS__); \
+	} while (0)
+
+	pthread_mutex_lock(&stats_lock);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	STATUS_PRINTF("state held\n");
+	STATUS_PRINTF("nodename %s\n", nodename);
+	STATUS_PRINTF("indexes");
+	for (i = 0; i < num_indexes; i++)
+		STATUS_PRINTF("%s%d", i ? "," : " ", lock_indexes[i]);
+	STATUS_PRINTF("\n");
+	STATUS_PRINTF("devices %d\n", num_replicas);
+	if (renew_stats.request[0])
+		STATUS_PRINTF("handoff_request %s\n", renew_stats.request);
+	STATUS_PRINTF("last_renewal %lld.%03ld\n",
+			(long long)renew_stats.last_ok_wall.tv_sec,
+			renew_stats.last_ok_wall.tv_nsec / 1000000);
+	STATUS_PRINTF("renewal_age_ms %ld\n",
+			(long)((now.tv_sec - renew_stats.last_ok.tv_sec) * 1000
+			+ (now.tv_nsec - renew_stats.last_ok.tv_nsec) / 1000000));
+	STATUS_PRINTF("lock_timeout_ms %ld\n", lock_timeout);
+	STATUS_PRINTF("monitor_interval_ms %ld\n", monitor_interval);
+	STATUS_PRINTF("renewals %lu\n", renew_stats.count);
+	STATUS_PRINTF("renewal_last_ms %ld\n", renew_stats.last_ms);
+	STATUS_PRINTF("renewal_max_ms %ld\n", renew_stats.max_ms);
+	STATUS_PRINTF("renewal_sum_ms %llu\n", renew_stats.sum_ms);
+	STATUS_PRINTF("renewal_warnings %lu\n", renew_stats.warnings);
+	for (b = 0; b < RENEW_LATENCY_BUCKETS; b++)
+		STATUS_PRINTF("renewal_le_%ld_ms %lu\n", renew_latency_bounds[b],
+				renew_stats.buckets[b]);
+	STATUS_PRINTF("renewal_gt_%ld_ms %lu\n",
+			renew_latency_bounds[RENEW_LATENCY_BUCKETS - 1],
+			renew_stats.buckets[RENEW_LATENCY_BUCKETS]);
+	pthread_mutex_unlock(&stats_lock);
+#undef STATUS_PRINTF
+
+	return n < len ? (int)n : (int)len - 1;
+}
+
+static void *status_thread_main(void *arg)
+{
+	static char buf[4096];
+
+	while (1) {
+		int len, off = 0;
+		int fd = accept(status_fd, NULL, NULL);
+
+		if (fd == -1) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				cl_log(LOG_ERR, "accept on %s failed: %s\n", status_path, strerror(errno));
+			continue;
+		}
+		len = format_status(buf, sizeof(buf));
+		while (off < len) {
+			ssize_t w = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+			if (w == -1) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+			off += w;
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+static void start_status_thread(void)
+{
+	struct sockaddr_un addr;
+	sigset_t all, old;
+	int rc;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(status_path) >= sizeof(addr.sun_path)) {
+		cl_log(LOG_ERR, "status socket path %s is too long.\n", status_path);
+		goto fail;
+	}
+	strncpy(addr.sun_path, status_path, sizeof(addr.sun_path) - 1);
+
+	status_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (status_fd == -1) {
+		cl_log(LOG_ERR, "can't create the status socket: %s\n", strerror(errno));
+		goto fail;
+	}
+	unlink(status_path);
+	if (bind(status_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+			|| listen(status_fd, 8) == -1) {
+		cl_log(LOG_ERR, "can't listen on %s: %s\n", status_path, strerror(errno));
+		goto fail;
+	}
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rc = pthread_create(&status_thread, NULL, status_thread_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc != 0) {
+		cl_log(LOG_ERR, "can't start the status thread: %s\n", strerror(rc));
+		goto fail;
+	}
+	return;
+fail:
+	release_lock();
+	exit(EXIT_FAILURE);
+}
+
 static void failure_todo(void)
 {
 #ifdef SFEX_TESTING	
@@ -125,52 +1046,290 @@ static void failure_todo(void)
 #endif
 }
 
-static void update_lock(void)
+/* one renewal cycle, run in io_thread */
+/*
+ * With COMPARE AND WRITE a renewal is a single command per lock that only
+ * succeeds if the lock is as this node last wrote it. If it is not, the
+ * lock is read again: a waiting node may have put in a request, anything
+ * else means the lock was lost.
+ */
+static int renew_locks_caw(void)
 {
-	/* read lock data */
-	if (read_lockdata(&cdata, &ldata, lock_index) == -1) {
-		cl_log(LOG_ERR, "read_lockdata failed in update_lock\n");
-		error_todo();
-		exit(EXIT_FAILURE);
+	struct timespec issued;
+	int i, tries, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &issued);
+	for (i = 0; i < num_indexes; i++) {
+		uint8_t *raw = caw_raw + cdata.blocksize * i;
+		sfex_lockdata new;
+
+		for (tries = 0; ; tries++) {
+			check_request(&ldata[i], i);
+			new = ldata[i];
+			new.count = next_lockcount(&cdata, ldata[i].count);
+			ret = compare_and_write_lockdata(replicas[0].dev, &cdata, &new,
+					lock_indexes[i], raw);
+			if (ret == 0)
+				break;
+			if (ret == -1 || tries == 2)
+				return RENEW_WRITE_FAILED;
+			if (read_device_lockblock(replicas[0].dev, &cdata, &ldata[i],
+						lock_indexes[i], raw) == -1)
+				return RENEW_READ_FAILED;
+			if (!held_by_own_node(&ldata[i])) {
+				cl_log(LOG_ERR, "can't update lock #%d.\n", lock_indexes[i]);
+				return RENEW_LOST;
+			}
+		}
+		ldata[i] = new;
 	}
+	publish_request();
+
+	pthread_mutex_lock(&io_lock);
+	last_write = issued;
+	pthread_mutex_unlock(&io_lock);
+	return RENEW_OK;
+}
+
+static int renew_locks(void)
+{
+	struct timespec issued;
+	int i;
+
+	if (use_caw)
+		return renew_locks_caw();
+
+	/* read lock data */
+	if (read_locks(ldata) == -1)
+		return RENEW_READ_FAILED;
 
 	/* check current lock status */
 	/* if own node is not locking, lock update is failed */
-	if (ldata.status != SFEX_STATUS_LOCK || strncmp((const char*)(ldata.nodename), nodename, sizeof(ldata.nodename))) {
-		cl_log(LOG_ERR, "can't update lock.\n");
-		failure_todo();
-		exit(EXIT_FAILURE); 
+	/* Losing any one of the locks fences, as its own daemon would have. */
+	for (i = 0; i < num_indexes; i++) {
+		if (!held_by_own_node(&ldata[i])) {
+			cl_log(LOG_ERR, "can't update lock #%d.\n", lock_indexes[i]);
+			return RENEW_LOST;
+		}
 	}
 
+	/* requests are kept for the handoff at release, stale ones dropped */
+	for (i = 0; i < num_indexes; i++)
+		check_request(&ldata[i], i);
+	publish_request();
+
 	/* lock update */
-	ldata.count = SFEX_NEXT_COUNT(ldata.count);
-	if (write_lockdata(&cdata, &ldata, lock_index) == -1) {
+	for (i = 0; i < num_indexes; i++)
+		ldata[i].count = next_lockcount(&cdata, ldata[i].count);
+	clock_gettime(CLOCK_MONOTONIC, &issued);
+	if (write_locks(ldata) == -1)
+		return RENEW_WRITE_FAILED;
+
+	pthread_mutex_lock(&io_lock);
+	last_write = issued;
+	pthread_mutex_unlock(&io_lock);
+	return RENEW_OK;
+}
+
+static void *io_thread_main(void *arg)
+{
+	pthread_mutex_lock(&io_lock);
+	while (1) {
+		while (!io_requested)
+			pthread_cond_wait(&io_cond, &io_lock);
+		io_requested = 0;
+		pthread_mutex_unlock(&io_lock);
+
+		io_result = renew_locks();
+
+		pthread_mutex_lock(&io_lock);
+		io_done = 1;
+		pthread_cond_broadcast(&io_cond);
+	}
+	return NULL;
+}
+
+static void start_io_thread(void)
+{
+	pthread_condattr_t attr;
+	sigset_t all, old;
+	int rc;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&io_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* signals are handled by the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rc = pthread_create(&io_thread, NULL, io_thread_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc != 0) {
+		cl_log(LOG_ERR, "can't start the I/O thread: %s\n", strerror(rc));
+		release_lock();
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Another node takes a lock over no earlier than lock_timeout after the
+ * last write it saw, so a renewal must be done well before that. One
+ * monitor_interval is kept as the margin, reduced for short lock_timeouts
+ * so that the renewal still gets half of the remaining time.
+ */
+static long renew_margin(void)
+{
+	long margin = (lock_timeout - monitor_interval) / 2;
+
+	return margin < monitor_interval ? margin : monitor_interval;
+}
+
+/*
+ * open_watchdog --- arm the watchdog with watchdog_timeout seconds
+ *
+ * A driver that cannot do the timeout exactly may round it. Rounding up
+ * could let the lock expire on the other nodes before the reset, so
+ * only rounding down is accepted.
+ */
+static void open_watchdog(void)
+{
+	int timeout = watchdog_timeout;
+
+	watchdog_fd = open(watchdog_path, O_WRONLY);
+	if (watchdog_fd == -1) {
+		cl_log(LOG_ERR, "can't open watchdog %s: %s\n", watchdog_path, strerror(errno));
+		release_lock();
+		exit(EXIT_FAILURE);
+	}
+	if (ioctl(watchdog_fd, WDIOC_SETTIMEOUT, &timeout) == -1
+			|| ioctl(watchdog_fd, WDIOC_GETTIMEOUT, &timeout) == -1) {
+		cl_log(LOG_ERR, "can't set the timeout of watchdog %s: %s\n", watchdog_path, strerror(errno));
+		close_watchdog();
+		release_lock();
+		exit(EXIT_FAILURE);
+	}
+	if (timeout > watchdog_timeout || timeout * 1000L <= monitor_interval) {
+		cl_log(LOG_ERR, "watchdog %s set a timeout of %d seconds, %d seconds were requested.\n",
+				watchdog_path, timeout, watchdog_timeout);
+		close_watchdog();
+		release_lock();
+		exit(EXIT_FAILURE);
+	}
+	watchdog_timeout = timeout;
+	cl_log(LOG_INFO, "watchdog %s armed with a timeout of %d seconds\n", watchdog_path, timeout);
+}
+
+static void pet_watchdog(void)
+{
+	if (ioctl(watchdog_fd, WDIOC_KEEPALIVE, 0) == -1)
+		cl_log(LOG_ERR, "can't pet watchdog %s: %s\n", watchdog_path, strerror(errno));
+}
+
+/* the magic close disarms the watchdog unless the driver has nowayout */
+static void close_watchdog(void)
+{
+	if (watchdog_fd == -1)
+		return;
+	if (write(watchdog_fd, "V", 1) != 1)
+		cl_log(LOG_ERR, "can't disarm watchdog %s: %s\n", watchdog_path, strerror(errno));
+	close(watchdog_fd);
+	watchdog_fd = -1;
+}
+
+static void update_lock(void)
+{
+	struct timespec deadline, start, end, written;
+	int rc = 0, result;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&io_lock);
+	deadline = last_write;
+	timespec_add_ms(&deadline, lock_timeout - renew_margin());
+	io_done = 0;
+	io_requested = 1;
+	pthread_cond_broadcast(&io_cond);
+	while (!io_done && rc != ETIMEDOUT)
+		rc = pthread_cond_timedwait(&io_cond, &io_lock, &deadline);
+	result = io_done ? io_result : -1;
+	written = last_write;
+	pthread_mutex_unlock(&io_lock);
+
+	switch (result) {
+	case RENEW_OK:
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		/* The reset must come before the lock can expire, which is
+		   lock_timeout after this write was issued. A write that took
+		   too long to leave room for the watchdog timeout is not
+		   trusted to pet it. */
+		if (watchdog_fd != -1
+				&& (end.tv_sec - written.tv_sec) * 1000
+				+ (end.tv_nsec - written.tv_nsec) / 1000000
+				<= lock_timeout - watchdog_timeout * 1000L)
+			pet_watchdog();
+		record_renewal((end.tv_sec - start.tv_sec) * 1000
+				+ (end.tv_nsec - start.tv_nsec) / 1000000);
+		break;
+	case RENEW_READ_FAILED:
+		cl_log(LOG_ERR, "read_lockdata failed in update_lock\n");
+		error_todo();
+		exit(EXIT_FAILURE);
+	case RENEW_LOST:
+		failure_todo();
+		exit(EXIT_FAILURE);
+	case RENEW_WRITE_FAILED:
 		cl_log(LOG_ERR, "write_lockdata failed in update_lock\n");
 		error_todo();
 		exit(EXIT_FAILURE);
+	default:
+		/* The disk did not answer in time. Others may take the lock
+		   over soon, so stop using the resources now. */
+		cl_log(LOG_ERR, "lock renewal did not complete within %ld ms of the last write.\n",
+				lock_timeout - renew_margin());
+		failure_todo();
+		exit(EXIT_FAILURE);
 	}
 }
 
 static void release_lock(void)
 {
+	int i, own = 0;
+
 	/* The only thing I care about in release_lock(), is to terminate the process */
 	   
 	/* read lock data */
-	if (read_lockdata(&cdata, &ldata, lock_index) == -1) {
+	if (read_locks(ldata) == -1) {
 		cl_log(LOG_ERR, "read_lockdata failed in release_lock\n");
 		exit(EXIT_FAILURE);
 	}
 
 	/* check current lock status */
 	/* if own node is not locking, we judge that lock has been released already */
-	if (ldata.status != SFEX_STATUS_LOCK || strncmp((const char*)(ldata.nodename), nodename, sizeof(ldata.nodename))) {
-		cl_log(LOG_ERR, "lock was already released.\n");
-		exit(EXIT_FAILURE);
+	for (i = 0; i < num_indexes; i++) {
+		if (held_by_own_node(&ldata[i])) {
+			ldata[i].status = SFEX_STATUS_UNLOCK;
+			/* with several devices a release must outrank the copies
+			   it may not reach */
+			if (num_replicas > 1)
+				ldata[i].count = next_lockcount(&cdata, ldata[i].count);
+			/* a live request turns the release into a handoff, which
+			   the waiting node must see as a new generation */
+			if (check_request(&ldata[i], i)) {
+				if (num_replicas == 1)
+					ldata[i].count = next_lockcount(&cdata, ldata[i].count);
+				cl_log(LOG_INFO, "handing lock #%d off to node %s.\n",
+						lock_indexes[i], ldata[i].request);
+			}
+			own++;
+		} else {
+			cl_log(LOG_ERR, "lock #%d was already released.\n", lock_indexes[i]);
+		}
 	}
+	if (!own)
+		exit(EXIT_FAILURE);
 
 	/* lock release */
-	ldata.status = SFEX_STATUS_UNLOCK;
-	if (write_lockdata(&cdata, &ldata, lock_index) == -1) {
+	if (write_locks(ldata) == -1) {
 	    /*FIXME: We are going to self-stop */
 		cl_log(LOG_ERR, "write_lockdata failed in release_lock\n");
 		exit(EXIT_FAILURE);
@@ -178,10 +1337,144 @@ static void release_lock(void)
 	cl_log(LOG_INFO, "lock released\n");
 }
 
+/* Open the devices and check their meta-data. A minority of them may be
+   unusable, the others must agree on the format. */
+static void open_replicas(void)
+{
+	int i, usable = 0;
+
+	for (i = 0; i < num_replicas; i++) {
+		struct replica *r = &replicas[i];
+		sfex_controldata c;
+
+		r->dev = open_device(r->path);
+		if (!r->dev)
+			continue;
+		if (read_device_controldata(r->dev, &c) == -1) {
+			cl_log(LOG_ERR, "can't read control data of %s\n", r->path);
+			close_device(r->dev);
+			r->dev = NULL;
+			continue;
+		}
+		if (lock_indexes[num_indexes - 1] > c.numlocks) {
+			cl_log(LOG_ERR, "index %d is too large. %d locks are stored on %s.\n",
+					lock_indexes[num_indexes - 1], c.numlocks, r->path);
+			exit(EXIT_FAILURE);
+		}
+		if (c.blocksize != device_sector_size(r->dev)) {
+			cl_log(LOG_ERR, "sector_size of %s is not the same as the blocksize.\n", r->path);
+			exit(EXIT_FAILURE);
+		}
+		if (usable && (c.version != cdata.version || c.blocksize != cdata.blocksize
+					|| c.numlocks != cdata.numlocks)) {
+			cl_log(LOG_ERR, "meta-data of %s do not match the other devices.\n", r->path);
+			exit(EXIT_FAILURE);
+		}
+		cdata = c;
+		usable++;
+	}
+	if (usable <= num_replicas / 2) {
+		cl_log(LOG_ERR, "only %d of %d devices are usable.\n", usable, num_replicas);
+		exit(EXIT_FAILURE);
+	}
+	if (num_replicas > 1 && cdata.version != SFEX_VERSION_V2) {
+		cl_log(LOG_ERR, "several devices need version %d meta-data.\n", SFEX_VERSION_V2);
+		exit(EXIT_FAILURE);
+	}
+	if (check_nodename(&cdata, nodename) == -1)
+		exit(EXIT_FAILURE);
+
+	/* An atomic update on one device is not atomic on a majority, so
+	   replicas keep the collision wait. */
+	if (num_replicas == 1 && device_caw_supported(replicas[0].dev, &cdata)) {
+		caw_raw = malloc(cdata.blocksize * num_indexes);
+		if (caw_raw == NULL) {
+			cl_log(LOG_ERR, "%s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		use_caw = 1;
+		cl_log(LOG_INFO, "%s supports COMPARE AND WRITE, locks are updated atomically.\n",
+				replicas[0].path);
+	}
+}
+
+/*
+ * Like daemon(0, 1), but the parent waits until the child has acquired
+ * the lock and exits with the child's result, so the caller still learns
+ * whether the lock was acquired. The I/O threads are started in the child
+ * and need not survive a later fork. Returns the fd the child writes to
+ * once it holds the lock.
+ */
+static int detach(void)
+{
+	int fds[2], status;
+	pid_t pid;
+	char c;
+
+	if (pipe(fds) == -1)
+		return -1;
+	pid = fork();
+	if (pid == -1)
+		return -1;
+	if (pid > 0) {
+		ssize_t n;
+
+		close(fds[1]);
+		do {
+			n = read(fds[0], &c, 1);
+		} while (n == -1 && errno == EINTR);
+		if (n == 1)
+			exit(EXIT_SUCCESS);
+		if (waitpid(pid, &status, 0) == pid && WIFEXITED(status))
+			exit(WEXITSTATUS(status));
+		exit(EXIT_FAILURE);
+	}
+	close(fds[0]);
+	if (setsid() == -1 || chdir("/") == -1) {
+		close(fds[1]);
+		return -1;
+	}
+	return fds[1];
+}
+
+/* The lock is released by the main thread, never from the handler: the
+   release does replicated I/O under replica_lock, which the interrupted
+   code may be holding. */
 static void quit_handler(int signo, siginfo_t *info, void *context)
 {
-	cl_log(LOG_INFO, "quit_handler called. now releasing lock\n");
+	quit_requested = 1;
+}
+
+/* Sleep until deadline with SIGTERM blocked by the caller, so that a
+   signal arriving just before the sleep is not missed. Returns 1 if the
+   daemon is to quit. */
+static int wait_for_quit(const struct timespec *deadline, const sigset_t *term)
+{
+	struct timespec now, left;
+
+	while (!quit_requested) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left.tv_sec = deadline->tv_sec - now.tv_sec;
+		left.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+		if (left.tv_nsec < 0) {
+			left.tv_sec--;
+			left.tv_nsec += 1000000000L;
+		}
+		if (left.tv_sec < 0)
+			return 0;
+		if (sigtimedwait(term, NULL, &left) == SIGTERM)
+			return 1;
+	}
+	return 1;
+}
+
+static void quit(void)
+{
+	cl_log(LOG_INFO, "SIGTERM received. now releasing lock\n");
+	if (status_path)
+		unlink(status_path);
 	release_lock();
+	close_watchdog();
 	cl_log(LOG_INFO, "Shutdown sfex_daemon with EXIT_SUCCESS\n");
 	exit(EXIT_SUCCESS);
 }
@@ -189,7 +1482,7 @@ static void quit_handler(int signo, siginfo_t *info, void *context)
 int main(int argc, char *argv[])
 {	
 
-	int ret;
+	int ret, notify_fd;
 
 	progname = get_progname(argv[0]);
 	nodename = get_nodename();
@@ -201,69 +1494,90 @@ int main(int argc, char *argv[])
 	/* read command line option */
 	opterr = 0;
 	while (1) {
-		int c = getopt(argc, argv, "hi:c:t:m:n:r:");
+		int c = getopt(argc, argv, "hi:c:t:m:n:r:l:e:s:w:");
 		if (c == -1)
 			break;
 		switch (c) {
 			case 'h':           /* help*/
 				usage(stdout);
 				exit(EXIT_SUCCESS);
-			case 'i':           /* -i <index> */
-				{
-					unsigned long l = strtoul(optarg, NULL, 10);
-					if (l < SFEX_MIN_NUMLOCKS || l > SFEX_MAX_NUMLOCKS) {
-						cl_log(LOG_ERR, 
-								"index %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
-								optarg,
-								(unsigned long)SFEX_MIN_NUMLOCKS,
-								(unsigned long)SFEX_MAX_NUMLOCKS);
-						exit(4);
-					}
-					lock_index = l;
+			case 'i':           /* -i <index>[,<index>|,<first>-<last>]... */
+				if (parse_indexes(optarg) == -1) {
+					cl_log(LOG_ERR, 
+							"index %s is out of range or invalid. it must be a list of integer values or ranges between %lu and %lu.\n",
+							optarg,
+							(unsigned long)SFEX_MIN_NUMLOCKS,
+							(unsigned long)SFEX_MAX_NUMLOCKS);
+					exit(4);
 				}
 				break;
 			case 'c':           /* -c <collision_timeout> */
-				{
-					unsigned long l = strtoul(optarg, NULL, 10);
-					if (l < 1 || l > INT_MAX) {
-						cl_log(LOG_ERR, 
-								"collision_timeout %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
-								optarg,
-								(unsigned long)1,
-								(unsigned long)INT_MAX);
-						exit(4);
-					}
-					collision_timeout = l;
+				if (parse_msec(optarg, &collision_timeout) == -1) {
+					cl_log(LOG_ERR, 
+							"collision_timeout %s is out of range or invalid. it must be integer value between %lu and %lu seconds, or %lu and %lu with the ms suffix.\n",
+							optarg,
+							(unsigned long)1,
+							(unsigned long)(INT_MAX / 1000),
+							(unsigned long)1,
+							(unsigned long)INT_MAX);
+					exit(4);
 				}
 				break;
 			case 'm':  			/* -m <monitor_interval> */
-				{
-					unsigned long l = strtoul(optarg, NULL, 10);
-					if (l < 1 || l > INT_MAX) {
-						cl_log(LOG_ERR, 
-								"monitor_interval %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
-								optarg,
-								(unsigned long)1,
-								(unsigned long)INT_MAX);
-						exit(4);
-					}
-					monitor_interval = l;
+				if (parse_msec(optarg, &monitor_interval) == -1) {
+					cl_log(LOG_ERR, 
+							"monitor_interval %s is out of range or invalid. it must be integer value between %lu and %lu seconds, or %lu and %lu with the ms suffix.\n",
+							optarg,
+							(unsigned long)1,
+							(unsigned long)(INT_MAX / 1000),
+							(unsigned long)1,
+							(unsigned long)INT_MAX);
+					exit(4);
 				}
 				break;	
 			case 't':           /* -t <lock_timeout> */
+				if (parse_msec(optarg, &lock_timeout) == -1) {
+					cl_log(LOG_ERR, 
+							"lock_timeout %s is out of range or invalid. it must be integer value between %lu and %lu seconds, or %lu and %lu with the ms suffix.\n",
+							optarg,
+							(unsigned long)1,
+							(unsigned long)(INT_MAX / 1000),
+							(unsigned long)1,
+							(unsigned long)INT_MAX);
+					exit(4);
+				}
+				break;
+			case 'l':           /* -l <latency_warning> */
+				if (parse_msec(optarg, &latency_warning) == -1) {
+					cl_log(LOG_ERR, 
+							"latency_warning %s is out of range or invalid. it must be integer value between %lu and %lu seconds, or %lu and %lu with the ms suffix.\n",
+							optarg,
+							(unsigned long)1,
+							(unsigned long)(INT_MAX / 1000),
+							(unsigned long)1,
+							(unsigned long)INT_MAX);
+					exit(4);
+				}
+				break;
+			case 'e':           /* -e <percent> */
 				{
-					unsigned long l = strtoul(optarg, NULL, 10);
-					if (l < 1 || l > INT_MAX) {
+					char *end;
+					unsigned long l = strtoul(optarg, &end, 10);
+					if (*end != '\0' || l < 1 || l > 99) {
 						cl_log(LOG_ERR, 
-								"lock_timeout %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
-								optarg,
-								(unsigned long)1,
-								(unsigned long)INT_MAX);
+								"early release %s is out of range or invalid. it must be integer value between 1 and 99.\n",
+								optarg);
 						exit(4);
 					}
-					lock_timeout = l;
+					early_release = l;
 				}
 				break;
+			case 's':           /* -s <status_socket> */
+				status_path = optarg;
+				break;
+			case 'w':           /* -w <watchdog_device> */
+				watchdog_path = optarg;
+				break;
 			case 'n':
 				{
 					free(nodename);
@@ -287,18 +1601,33 @@ int main(int argc, char *argv[])
 		}
 	}
 	/* check parameter except the option */
-	if (optind >= argc) {
+	num_replicas = argc - optind;
+	if (num_replicas == 0) {
 		cl_log(LOG_ERR, "no device specified.\n");
 		usage(stderr);
 		exit(EXIT_FAILURE);
-	} else if (optind + 1 < argc) {
-		cl_log(LOG_ERR, "too many arguments.\n");
+	} else if (num_replicas != 1 && num_replicas != 3 && num_replicas != 5) {
+		cl_log(LOG_ERR, "%d devices given, 1, 3 or 5 devices are needed.\n", num_replicas);
 		usage(stderr);
 		exit(EXIT_FAILURE);
 	}
-	device = argv[optind];
+	for (ret = 0; ret < num_replicas; ret++)
+		replicas[ret].path = argv[optind + ret];
 
-	prepare_lock(device);
+	if (lock_timeout <= monitor_interval) {
+		cl_log(LOG_ERR, "lock_timeout must be longer than monitor_interval.\n");
+		exit(4);
+	}
+	if (watchdog_path) {
+		/* whole seconds, and the watchdog must outlast a renewal interval */
+		watchdog_timeout = (lock_timeout - monitor_interval) / 1000;
+		if (watchdog_timeout < 1 || watchdog_timeout * 1000L <= monitor_interval) {
+			cl_log(LOG_ERR, "with a watchdog, lock_timeout - monitor_interval must be at least 1 second and longer than monitor_interval.\n");
+			exit(4);
+		}
+	}
+
+	open_replicas();
 #if !SFEX_TESTING
 	sysrq_fd = open("/proc/sysrq-trigger", O_WRONLY);
 	if (sysrq_fd == -1) {
@@ -307,9 +1636,11 @@ int main(int argc, char *argv[])
 	}
 #endif
 
-	ret = lock_index_check(&cdata, lock_index);
-	if (ret == -1)
+	notify_fd = detach();
+	if (notify_fd == -1) {
+		cl_perror("%s::%d: detach failed.", __FUNCTION__, __LINE__);
 		exit(EXIT_FAILURE);
+	}
 
 	{
 		struct sigaction sig_act;
@@ -325,21 +1656,44 @@ int main(int argc, char *argv[])
 	}
 
 	cl_log(LOG_INFO, "Starting SFeX Daemon...\n");
-	
+
+	start_replica_threads();
+
 	/* acquire lock first.*/
 	acquire_lock();
+	mark_renewed();
+	if (watchdog_path)
+		open_watchdog();
 
-	if (daemon(0, 1) != 0) {
-		cl_perror("%s::%d: daemon() failed.", __FUNCTION__, __LINE__);
-		release_lock();
-		exit(EXIT_FAILURE);
-	}
+	/* let the parent report success */
+	if (write(notify_fd, "", 1) != 1)
+		cl_log(LOG_ERR, "can't notify the parent: %s\n", strerror(errno));
+	close(notify_fd);
 
 	cl_make_realtime(-1, -1, 128, 128);
+
+	start_io_thread();
+	if (status_path)
+		start_status_thread();
 	
 	cl_log(LOG_INFO, "SFeX Daemon started.\n");
-	while (1) {
-		sleep (monitor_interval);
-		update_lock();
+	{
+		struct timespec next;
+		sigset_t term;
+
+		/* SIGTERM is only taken between renewals from here on */
+		sigemptyset(&term);
+		sigaddset(&term, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &term, NULL);
+
+		/* renewals are scheduled from absolute deadlines, so the time
+		   spent in update_lock() does not stretch the interval */
+		clock_gettime(CLOCK_MONOTONIC, &next);
+		while (1) {
+			timespec_add_ms(&next, monitor_interval);
+			if (wait_for_quit(&next, &term))
+				quit();
+			update_lock();
+		}
 	}
 }
@@ -25,7 +25,8 @@
  *
  *-------------------------------------------------------------------------
  *
- * sfex_init [-b <blocksize>] [-n <numlocks>] <device>
+ * sfex_init [-b <blocksize>] [-n <numlocks>] [-v <version>] <device>...
+ * sfex_init -m <device>...
  *
  * -b <blocksize> --- The size of the block is specified by the number of 
  * bytes. In general, to prevent a partial writing to the disk, the size 
@@ -41,8 +42,23 @@
  * meta-data, you set the value of two or more to numlocks. A necessary disk 
  * area for meta data are (blocksize*(1+numlocks))bytes. Default is 1.
  *
+ * -v <version> --- The on-disk format of the meta-data, 1 or 2. Version 2 
+ * stores binary little-endian fields with a CRC32C checksum in each block 
+ * and a 64 bit lock count that does not wrap. Every node sharing the 
+ * meta-data must understand the chosen version. Default is 1, or 2 when 
+ * several devices are given.
+ *
+ * -m --- Migrate existing version 1 meta-data to version 2 in place. The 
+ * number of locks and the lock counts are kept. No lock may be held while 
+ * migrating.
+ *
  * <device> --- This is file path which stored meta-data. It is usually 
- * expressed in "/dev/...", because it is partition on the shared disk.
+ * expressed in "/dev/...", because it is partition on the shared disk. 
+ * A lock area replicated by sfex_daemon is given as 3 or 5 devices, all 
+ * of them are initialized the same way. Replicas need version 2.
+ *
+ * The meta-data of each device is written with a single request, then read 
+ * back and compared. The time taken is reported on stdout.
  *
  * exit code --- 0 - Normal end. 3 - Error occurs while processing it. 
  * The content of the error is displayed into stderr. 4 - The mistake is 
@@ -57,6 +73,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <time.h>
 
 #include "sfex.h"
 #include "sfex_lib.h"
@@ -75,7 +92,146 @@ char *nodename;
  * return value --- void
  */
 static void usage(FILE *dist) {
-  fprintf(dist, "usage: %s [-n <numlocks>] <device>\n", progname);
+  fprintf(dist, "usage: %s [-n <numlocks>] [-v <version>] <device> [<device> <device> [<device> <device>]]\n"
+	  "       %s -m <device>...\n", progname, progname);
+}
+
+/*
+ * migrate --- convert version 1 meta-data to version 2 in place
+ *
+ * The lock blocks are written first and the control block last, so the 
+ * area is read as version 1 until the migration is complete. A lock 
+ * block that already passes the version 2 checksum was converted by an 
+ * interrupted run, which is finished by writing the rest.
+ *
+ * exit code --- 0 - Normal end. 3 - Error occurs while processing it. 
+ */
+static int
+migrate(void) {
+  sfex_controldata cdata, v2;
+  sfex_lockdata *ldata;
+  int i, converted = 0, ret = 3;
+
+  if (read_controldata(&cdata) == -1) {
+    fprintf(stderr, "%s: ERROR: cannot read control data.\n", progname);
+    return 3;
+  }
+  if (cdata.version == SFEX_VERSION_V2) {
+    fprintf(stderr, "%s: meta-data is already version %d.\n",
+	    progname, SFEX_VERSION_V2);
+    return 0;
+  }
+  ldata = calloc(cdata.numlocks, sizeof(*ldata));
+  if (ldata == NULL) {
+    fprintf(stderr, "%s: ERROR: %s\n", progname, strerror(errno));
+    return 3;
+  }
+  v2 = cdata;
+  v2.version = SFEX_VERSION_V2;
+  /* a version 1 block fails the version 2 checksum, but a version 2 block
+     may well parse as version 1: try version 2 first */
+  cl_log_enable_stderr(FALSE);
+  for (i = 0; i < cdata.numlocks; i++) {
+    if (read_lockdata(&v2, &ldata[i], i + 1) == 0)
+      converted++;
+    else if (read_lockdata(&cdata, &ldata[i], i + 1) == -1)
+      break;
+  }
+  cl_log_enable_stderr(TRUE);
+  if (i < cdata.numlocks) {
+    fprintf(stderr, "%s: ERROR: cannot read lock data #%d.\n", progname, i + 1);
+    goto out;
+  }
+  if (converted)
+    fprintf(stderr, "%s: finishing an interrupted migration, %d of %d locks were converted.\n",
+	    progname, converted, cdata.numlocks);
+  for (i = 0; i < cdata.numlocks; i++) {
+    if (ldata[i].status == SFEX_STATUS_LOCK) {
+      fprintf(stderr, "%s: ERROR: lock data #%d is held by %s, release it before migrating.\n",
+	      progname, i + 1, ldata[i].nodename);
+      goto out;
+    }
+    if (check_nodename(&v2, ldata[i].nodename) == -1) {
+      fprintf(stderr, "%s: ERROR: lock data #%d cannot be migrated.\n",
+	      progname, i + 1);
+      goto out;
+    }
+  }
+
+  if (write_lockdata_range(&v2, ldata, 1, cdata.numlocks) == -1) {
+    fprintf(stderr, "%s: ERROR: cannot write lock data.\n", progname);
+    goto out;
+  }
+  write_controldata(&v2);
+  ret = 0;
+out:
+  free(ldata);
+  return ret;
+}
+
+/*
+ * initialize --- write new meta-data and read it back
+ *
+ * The whole area is written with a single request and verified with a 
+ * single read. The time taken is reported on stdout.
+ *
+ * exit code --- 0 - Normal end. 3 - Error occurs while processing it. 
+ */
+static int
+initialize(const char *device, int numlocks, int version) {
+  sfex_controldata cdata, check;
+  sfex_lockdata *ldata, *readback;
+  struct timespec start, end;
+  int i, ret = 3;
+
+  ldata = calloc(numlocks, sizeof(*ldata));
+  readback = calloc(numlocks, sizeof(*readback));
+  if (ldata == NULL || readback == NULL) {
+    fprintf(stderr, "%s: ERROR: %s\n", progname, strerror(errno));
+    goto out;
+  }
+  init_controldata(&cdata, sector_size, numlocks, version);
+  for (i = 0; i < numlocks; i++)
+    init_lockdata(&ldata[i]);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (write_lockarea(&cdata, ldata) == -1) {
+    fprintf(stderr, "%s: ERROR: cannot write meta-data to %s.\n",
+	    progname, device);
+    goto out;
+  }
+  check = cdata;
+  if (read_lockarea(&check, readback) == -1) {
+    fprintf(stderr, "%s: ERROR: cannot read back meta-data from %s.\n",
+	    progname, device);
+    goto out;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (check.version != cdata.version || check.blocksize != cdata.blocksize) {
+    fprintf(stderr, "%s: ERROR: control data read back from %s differs.\n",
+	    progname, device);
+    goto out;
+  }
+  for (i = 0; i < numlocks; i++) {
+    if (readback[i].status != ldata[i].status
+	|| readback[i].count != ldata[i].count
+	|| strcmp(readback[i].nodename, ldata[i].nodename) != 0) {
+      fprintf(stderr, "%s: ERROR: lock data #%d read back from %s differs.\n",
+	      progname, i + 1, device);
+      goto out;
+    }
+  }
+
+  printf("%s: %d locks written and verified on %s in %ld ms.\n",
+	 progname, numlocks, device,
+	 (long)((end.tv_sec - start.tv_sec) * 1000
+		+ (end.tv_nsec - start.tv_nsec) / 1000000));
+  ret = 0;
+out:
+  free(ldata);
+  free(readback);
+  return ret;
 }
 
 /*
@@ -89,12 +245,11 @@ static void usage(FILE *dist) {
  */
 int
 main(int argc, char *argv[]) {
-  sfex_controldata cdata;
-  sfex_lockdata ldata;
-
   /* command line parameter */
   int numlocks = 1;		/* default 1 locks  */
-  const char *device;
+  int version = 0;		/* default version 1, 2 for replicas */
+  int migrate_only = 0;
+  int num_devices, d;
 
   /*
    *  startup process
@@ -111,7 +266,7 @@ main(int argc, char *argv[]) {
   /* read command line option */
   opterr = 0;
   while (1) {
-    int c = getopt(argc, argv, "hn:");
+    int c = getopt(argc, argv, "hmn:v:");
     if (c == -1)
       break;
     switch (c) {
@@ -132,6 +287,17 @@ main(int argc, char *argv[]) {
 	numlocks = l;
       }
       break;
+    case 'v':			/* -v <version> */
+      version = atoi(optarg);
+      if (version != SFEX_VERSION && version != SFEX_VERSION_V2) {
+	fprintf(stderr, "%s: ERROR: version %s is invalid. it must be %d or %d.\n",
+		progname, optarg, SFEX_VERSION, SFEX_VERSION_V2);
+	exit(4);
+      }
+      break;
+    case 'm':			/* -m */
+      migrate_only = 1;
+      break;
     case '?':			/* error */
       usage(stderr);
       exit(4);
@@ -139,38 +305,41 @@ main(int argc, char *argv[]) {
   }
 
   /* check parameter except the option */
-  if (optind >= argc) {
+  num_devices = argc - optind;
+  if (num_devices == 0) {
     fprintf(stderr, "%s: ERROR: no device specified.\n", progname);
     usage(stderr);
     exit(4);
-  } else if (optind + 1 < argc) {
-    fprintf(stderr, "%s: ERROR: too many arguments.\n", progname);
+  } else if (num_devices != 1 && num_devices != 3 && num_devices != 5) {
+    fprintf(stderr, "%s: ERROR: %d devices given, 1, 3 or 5 devices are needed.\n",
+	    progname, num_devices);
     usage(stderr);
     exit(4);
   }
-  device = argv[optind];
-
-  prepare_lock(device);
-
-  /* main processes start */
+  if (version == 0)
+    version = num_devices > 1 ? SFEX_VERSION_V2 : SFEX_VERSION;
+  else if (num_devices > 1 && version != SFEX_VERSION_V2) {
+    fprintf(stderr, "%s: ERROR: several devices need version %d.\n",
+	    progname, SFEX_VERSION_V2);
+    exit(4);
+  }
 
   /* get a node name */
   nodename = get_nodename();
 
-  /* create and control data and lock data */
-  init_controldata(&cdata, sector_size, numlocks);
-  init_lockdata(&ldata);
-
-  /* write out control data and lock data */
-  write_controldata(&cdata);
-  {
-    int index;
-    for (index = 1; index <= numlocks; index++)
-      if (write_lockdata(&cdata, &ldata, index) == -1) {
-        fprintf(stderr, "%s: ERROR: cannot write lock data (index=%d).\n",
-                progname, index);
-        exit(3);
-      }
+  for (d = optind; d < argc; d++) {
+    int ret;
+
+    prepare_lock(argv[d]);
+
+    /* main processes start */
+    if (migrate_only)
+      ret = migrate();
+    else
+      /* create control data and lock data and write them out */
+      ret = initialize(argv[d], numlocks, version);
+    if (ret != 0)
+      exit(ret);
   }
 
   exit(0);
@@ -39,52 +39,231 @@
 #include <unistd.h>
 #include <sys/utsname.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
 #include <syslog.h>
 #include <linux/fs.h>
+#include <stddef.h>
+#include <time.h>
+#include <scsi/sg.h>
 
 #include "sfex.h"
 #include "sfex_lib.h"
 
-static void *locked_mem;
-static int dev_fd;
+static int parse_controldata (const void *block, size_t len,
+			      sfex_controldata * cdata);
+static int parse_lockdata (const sfex_controldata * cdata, const void *block,
+			   sfex_lockdata * ldata);
+
+/* state of one opened meta-data device */
+struct sfex_device {
+  int fd;
+  unsigned long sector_size;
+  void *locked_mem;		/* one block, for single block requests */
+  void *area_mem;		/* multi block buffer, grown on demand */
+  size_t area_size;
+  /* COMPARE AND WRITE, see device_caw_supported() */
+  int caw_blocks;		/* logical blocks per sfex block, 0 if unusable */
+  uint64_t caw_base;		/* LBA of the start of the device on its disk */
+};
+
+/* the device of prepare_lock(), used by the functions without a device */
+static sfex_device default_device;
 unsigned long sector_size = 0;
 
-int
-prepare_lock (const char *device)
+/* little-endian field helpers for the version 2 format */
+static void
+put_le32 (uint8_t * p, uint32_t v)
+{
+  int i;
+
+  for (i = 0; i < 4; i++)
+    p[i] = v >> (8 * i);
+}
+
+static void
+put_le64 (uint8_t * p, uint64_t v)
+{
+  int i;
+
+  for (i = 0; i < 8; i++)
+    p[i] = v >> (8 * i);
+}
+
+static uint32_t
+get_le32 (const uint8_t * p)
+{
+  return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16
+    | (uint32_t) p[3] << 24;
+}
+
+static uint64_t
+get_le64 (const uint8_t * p)
+{
+  return (uint64_t) get_le32 (p) | (uint64_t) get_le32 (p + 4) << 32;
+}
+
+/*
+ * block_crc --- CRC32C of a block, the 4 bytes at crc_offset count as zero
+ */
+static uint32_t crc_table[256];
+
+/* filled by setup_device(), before any I/O thread may exist */
+static void
+init_crc_table (void)
+{
+  uint32_t i;
+
+  for (i = 0; i < 256; i++) {
+    uint32_t c = i;
+    int k;
+
+    for (k = 0; k < 8; k++)
+      c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t
+block_crc (const void *block, size_t len, size_t crc_offset)
+{
+  static const uint8_t zero[4];
+  const uint8_t *p = block;
+  uint32_t crc = 0xFFFFFFFF;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    uint8_t b = (i >= crc_offset && i < crc_offset + 4)
+      ? zero[i - crc_offset] : p[i];
+
+    crc = crc_table[(crc ^ b) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static uint64_t
+now_msec (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * setup_device --- open a meta-data device and allocate its buffers
+ */
+static int
+setup_device (sfex_device * dev, const char *device)
 {
   int sec_tmp = 0;
+  int flags = O_RDWR | O_DIRECT | O_SYNC;
+  struct stat st;
+
+  init_crc_table ();
 
   do {
-    dev_fd = open (device, O_RDWR | O_DIRECT | O_SYNC);
-    if (dev_fd == -1) {
+    dev->fd = open (device, flags);
+    if (dev->fd == -1) {
       if (errno == EINTR || errno == EAGAIN)
 	continue;
+      /* file-backed meta-data on a file system without direct I/O */
+      if (errno == EINVAL && (flags & O_DIRECT)) {
+	flags &= ~O_DIRECT;
+	continue;
+      }
       cl_log(LOG_ERR, "can't open device %s: %s\n",
 		    device, strerror (errno));
-      exit (3);
+      return -1;
     }
     break;
   }
   while (1);
 
-  ioctl(dev_fd, BLKSSZGET, &sec_tmp);
-  sector_size = (unsigned long)sec_tmp;
-  if (sector_size == 0) {
+  if (fstat (dev->fd, &st) == 0 && S_ISREG (st.st_mode))
+    /* a regular file (e.g. for testing) has no sector size of its own */
+    sec_tmp = SFEX_FILE_BLOCKSIZE;
+  else
+    ioctl(dev->fd, BLKSSZGET, &sec_tmp);
+  dev->sector_size = (unsigned long)sec_tmp;
+  if (dev->sector_size == 0) {
 	  cl_log(LOG_ERR, "Get sector size failed: %s\n", strerror(errno));
-	  exit(EXIT_FAILURE);
+	  close (dev->fd);
+	  return -1;
   }
 
   if (posix_memalign
-      ((void **) (&locked_mem), SFEX_ODIRECT_ALIGNMENT,
-       sector_size) != 0) {
+      ((void **) (&dev->locked_mem), SFEX_ODIRECT_ALIGNMENT,
+       dev->sector_size) != 0) {
     cl_log(LOG_ERR, "Failed to allocate aligned memory\n");
-    exit (3);
+    close (dev->fd);
+    return -1;
+  }
+  memset (dev->locked_mem, 0, dev->sector_size);
+
+  return 0;
+}
+
+int
+prepare_lock (const char *device)
+{
+  /* called again for the next device of a replicated lock area */
+  if (default_device.locked_mem) {
+    close (default_device.fd);
+    free (default_device.locked_mem);
+    free (default_device.area_mem);
+    memset (&default_device, 0, sizeof (default_device));
   }
-  memset (locked_mem, 0, sector_size);
+  if (setup_device (&default_device, device) == -1)
+    exit (3);
+  sector_size = default_device.sector_size;
 
   return 0;
 }
 
+/*
+ * open_device --- open one more meta-data device
+ *
+ * Unlike prepare_lock(), a failure is returned as NULL, so the caller can 
+ * go on with the other devices of a replicated lock area.
+ */
+sfex_device *
+open_device (const char *device)
+{
+  sfex_device *dev;
+
+  dev = calloc (1, sizeof (*dev));
+  if (dev == NULL) {
+    cl_log(LOG_ERR, "%s\n", strerror (errno));
+    return NULL;
+  }
+  if (setup_device (dev, device) == -1) {
+    free (dev);
+    return NULL;
+  }
+  return dev;
+}
+
+/*
+ * close_device --- close a device of open_device()
+ */
+void
+close_device (sfex_device * dev)
+{
+  close (dev->fd);
+  free (dev->locked_mem);
+  free (dev->area_mem);
+  free (dev);
+}
+
+/*
+ * device_sector_size --- sector size of an opened device
+ */
+unsigned long
+device_sector_size (const sfex_device * dev)
+{
+  return dev->sector_size;
+}
+
 /*
  * get_progname --- a program name
  *
@@ -138,13 +317,15 @@ get_nodename (void)
 /*
  * init_controldata --- initialize control data
  *
- * We initialize each member of sfex_controldata structure.
+ * We initialize each member of sfex_controldata structure. version is
+ * SFEX_VERSION or SFEX_VERSION_V2 and selects the on-disk format.
  */
 void
-init_controldata (sfex_controldata * cdata, size_t blocksize, int numlocks)
+init_controldata (sfex_controldata * cdata, size_t blocksize, int numlocks,
+		  int version)
 {
   memcpy (cdata->magic, SFEX_MAGIC, sizeof (cdata->magic));
-  cdata->version = SFEX_VERSION;
+  cdata->version = version;
   cdata->revision = SFEX_REVISION;
   cdata->blocksize = blocksize;
   cdata->numlocks = numlocks;
@@ -161,6 +342,59 @@ init_lockdata (sfex_lockdata * ldata)
   ldata->status = SFEX_STATUS_UNLOCK;
   ldata->count = 0;
   ldata->nodename[0] = 0;
+  ldata->timestamp = 0;
+  ldata->request[0] = 0;
+}
+
+/*
+ * next_lockcount --- next value of the increment counter
+ *
+ * The version 1 counter wraps after SFEX_MAX_COUNT, the version 2 
+ * generation does not.
+ */
+uint64_t
+next_lockcount (const sfex_controldata * cdata, uint64_t count)
+{
+  if (cdata->version == SFEX_VERSION_V2)
+    return count + 1;
+  return SFEX_NEXT_COUNT (count);
+}
+
+/*
+ * format_controldata --- store control data into a zeroed on-disk block
+ */
+static void
+format_controldata (const sfex_controldata * cdata, void *buf)
+{
+  if (cdata->version == SFEX_VERSION_V2) {
+    sfex_controldata_ondisk_v2 *block = buf;
+
+    memcpy (block->magic, cdata->magic, sizeof (block->magic));
+    put_le32 (block->version, cdata->version);
+    put_le32 (block->revision, cdata->revision);
+    put_le64 (block->blocksize, cdata->blocksize);
+    put_le32 (block->numlocks, cdata->numlocks);
+    put_le32 (block->crc,
+	      block_crc (block, cdata->blocksize,
+			 offsetof (sfex_controldata_ondisk_v2, crc)));
+  } else {
+    sfex_controldata_ondisk *block = buf;
+
+    /* We write the offset value of each field of the control data directly.
+     * Because a point using this value is limited to two places, we do not 
+     * use macro. If you change the following offset values, you must change 
+     * values in the parse_controldata() function.
+     */
+    memcpy (block->magic, cdata->magic, sizeof (block->magic));
+    snprintf ((char *) (block->version), sizeof (block->version), "%d",
+	      cdata->version);
+    snprintf ((char *) (block->revision), sizeof (block->revision), "%d",
+	      cdata->revision);
+    snprintf ((char *) (block->blocksize), sizeof (block->blocksize), "%u",
+	      (unsigned)cdata->blocksize);
+    snprintf ((char *) (block->numlocks), sizeof (block->numlocks), "%d",
+	      cdata->numlocks);
+  }
 }
 
 /*
@@ -176,38 +410,20 @@ init_lockdata (sfex_lockdata * ldata)
 void
 write_controldata (const sfex_controldata * cdata)
 {
-  sfex_controldata_ondisk *block;
+  void *block;
   int fd;
 
-  block = (sfex_controldata_ondisk *) (locked_mem);
+  block = default_device.locked_mem;
 
   /* We write control data into the buffer with given format. */
-  /* We write the offset value of each field of the control data directly.
-   * Because a point using this value is limited to two places, we do not 
-   * use macro. If you change the following offset values, you must change 
-   * values in the read_controldata() function.
-   */
   memset (block, 0, cdata->blocksize);
-  memcpy (block->magic, cdata->magic, sizeof (block->magic));
-  snprintf ((char *) (block->version), sizeof (block->version), "%d",
-	    cdata->version);
-  snprintf ((char *) (block->revision), sizeof (block->revision), "%d",
-	    cdata->revision);
-  snprintf ((char *) (block->blocksize), sizeof (block->blocksize), "%u",
-	    (unsigned)cdata->blocksize);
-  snprintf ((char *) (block->numlocks), sizeof (block->numlocks), "%d",
-	    cdata->numlocks);
-
-  fd = dev_fd;
-  if (lseek (fd, 0, SEEK_SET) == -1) {
-    cl_log(LOG_ERR, "can't seek file pointer: %s\n",
-		  strerror (errno));
-    exit (3);
-  }
+  format_controldata (cdata, block);
+
+  fd = default_device.fd;
 
   /* write buffer into a file  */
   do {
-	  ssize_t s = write (fd, block, cdata->blocksize);
+	  ssize_t s = pwrite (fd, block, cdata->blocksize, 0);
 	  if (s == -1) {
 		  if (errno == EINTR || errno == EAGAIN)
 			  continue;
@@ -221,11 +437,42 @@ write_controldata (const sfex_controldata * cdata)
   while (1);
 }
 
+/*
+ * format_lockdata --- store lock data into a zeroed on-disk block
+ */
+static void
+format_lockdata (const sfex_controldata * cdata, const sfex_lockdata * ldata,
+		 void *buf)
+{
+  if (cdata->version == SFEX_VERSION_V2) {
+    sfex_lockdata_ondisk_v2 *block = buf;
+
+    block->status = ldata->status;
+    put_le64 (block->generation, ldata->count);
+    put_le64 (block->timestamp, now_msec ());
+    /* the names were checked with check_nodename(), the block is zeroed */
+    memcpy (block->nodename, ldata->nodename,
+	    strnlen (ldata->nodename, sizeof (block->nodename) - 1));
+    memcpy (block->request, ldata->request,
+	    strnlen (ldata->request, sizeof (block->request) - 1));
+    put_le32 (block->crc,
+	      block_crc (block, cdata->blocksize,
+			 offsetof (sfex_lockdata_ondisk_v2, crc)));
+  } else {
+    sfex_lockdata_ondisk *block = buf;
+
+    block->status = ldata->status;
+    snprintf ((char *) (block->count), sizeof (block->count), "%d",
+	      (int) ldata->count);
+    snprintf ((char *) (block->nodename), sizeof (block->nodename), "%s",
+	      ldata->nodename);
+  }
+}
+
 /*
  * write_lockdata --- write lock data into file
  *
- * We write sfex_lockdata into file and seek file pointer to the given
- * position of lock data.
+ * We write sfex_lockdata into file at the given position of lock data.
  *
  * cdata --- pointer for control data
  *
@@ -239,35 +486,20 @@ int
 write_lockdata (const sfex_controldata * cdata, const sfex_lockdata * ldata,
 		int index)
 {
-  sfex_lockdata_ondisk *block;
+  void *block;
   int fd;
 
-  block = (sfex_lockdata_ondisk *) locked_mem;
+  block = default_device.locked_mem;
   /* We write lock data into buffer with given format */
-  /* We write the offset value of each field of the control data directly.
-   * Because a point using this value is limited to two places, we do not 
-   * use macro. If you chage the following offset values, you must change 
-   * values in the read_lockdata() function.
-   */
   memset (block, 0, cdata->blocksize);
-  block->status = ldata->status;
-  snprintf ((char *) (block->count), sizeof (block->count), "%d",
-	    ldata->count);
-  snprintf ((char *) (block->nodename), sizeof (block->nodename), "%s",
-	    ldata->nodename);
-
-  fd = dev_fd;
-
-  /* seek a file pointer to given position */
-  if (lseek (fd, cdata->blocksize * index, SEEK_SET) == -1) {
-    cl_log(LOG_ERR, "can't seek file pointer: %s\n",
-		  strerror (errno));
-    return -1;
-  }
+  format_lockdata (cdata, ldata, block);
+
+  fd = default_device.fd;
 
-  /* write buffer into file */
+  /* write buffer into file at the position of the lock data */
   do {
-    ssize_t s = write (fd, block, cdata->blocksize);
+    ssize_t s = pwrite (fd, block, cdata->blocksize,
+			(off_t) cdata->blocksize * index);
     if (s == -1) {
       if (errno == EINTR || errno == EAGAIN)
 	continue;
@@ -298,19 +530,22 @@ write_lockdata (const sfex_controldata * cdata, const sfex_lockdata * ldata,
 int
 read_controldata (sfex_controldata * cdata)
 {
-  sfex_controldata_ondisk *block;
+  return read_device_controldata (&default_device, cdata);
+}
 
-  block = (sfex_controldata_ondisk *) (locked_mem);
+/*
+ * read_device_controldata --- read control data from the given device
+ */
+int
+read_device_controldata (sfex_device * dev, sfex_controldata * cdata)
+{
+  void *block;
 
-  if (lseek (dev_fd, 0, SEEK_SET) == -1) {
-    cl_log(LOG_ERR, "can't seek file pointer: %s\n",
-		  strerror (errno));
-    return -1;
-  }
+  block = dev->locked_mem;
 
   /* read data from file */
   do {
-	  ssize_t s = read (dev_fd, block, sector_size);
+	  ssize_t s = pread (dev->fd, block, dev->sector_size, 0);
 	  if (s == -1) {
 		  if (errno == EINTR || errno == EAGAIN)
 			  continue;
@@ -323,19 +558,61 @@ read_controldata (sfex_controldata * cdata)
 		  break;
   } while (1);
 
+  return parse_controldata (block, dev->sector_size, cdata);
+}
+
+/*
+ * parse_controldata --- parse control data read from file
+ *
+ * The format version is detected from the version field.
+ *
+ * block --- buffer holding the on-disk control data
+ *
+ * len --- number of bytes in the buffer
+ *
+ * cdata --- pointer for control data
+ */
+static int
+parse_controldata (const void *buf, size_t len, sfex_controldata * cdata)
+{
+  const sfex_controldata_ondisk *block = buf;
+
   /* read control data from buffer */
   /* 1. check the magic number.  2. check null terminator of each field 
      3. check the version number.  4. Unmuch of revision number is allowed  */
   /* We write the offset value of each field of the control data directly.
    * Because a point using this value is limited to two places, we do not 
    * use macro. If you chage the following offset values, you must change 
-   * values in the write_controldata() function.
+   * values in the format_controldata() function.
    */
   memcpy (cdata->magic, block->magic, 4);
   if (memcmp (cdata->magic, SFEX_MAGIC, sizeof (cdata->magic))) {
     cl_log(LOG_ERR, "magic number mismatched. %c%c%c%c <-> %s\n", block->magic[0], block->magic[1], block->magic[2], block->magic[3], SFEX_MAGIC);
     return -1;
   }
+
+  /* version 1 stores a printable number, version 2 a binary one */
+  if (get_le32 (block->version) == SFEX_VERSION_V2) {
+    const sfex_controldata_ondisk_v2 *block2 = buf;
+
+    cdata->version = SFEX_VERSION_V2;
+    cdata->revision = get_le32 (block2->revision);
+    cdata->blocksize = get_le64 (block2->blocksize);
+    cdata->numlocks = get_le32 (block2->numlocks);
+    if (cdata->blocksize < sizeof (sfex_lockdata_ondisk_v2)
+	|| cdata->blocksize > len) {
+      cl_log(LOG_ERR, "control data format error.\n");
+      return -1;
+    }
+    if (get_le32 (block2->crc)
+	!= block_crc (block2, cdata->blocksize,
+		      offsetof (sfex_controldata_ondisk_v2, crc))) {
+      cl_log(LOG_ERR, "control data checksum error.\n");
+      return -1;
+    }
+    return 0;
+  }
+
   if (block->version[sizeof (block->version)-1]
       || block->revision[sizeof (block->revision)-1]
       || block->blocksize[sizeof (block->blocksize)-1]
@@ -343,16 +620,16 @@ read_controldata (sfex_controldata * cdata)
     cl_log(LOG_ERR, "control data format error.\n");
     return -1;
   }
-  cdata->version = atoi ((char *) (block->version));
+  cdata->version = atoi ((const char *) (block->version));
   if (cdata->version != SFEX_VERSION) {
     cl_log(LOG_ERR,
-      "version number mismatched. program is %d, data is %d.\n",
-       SFEX_VERSION, cdata->version);
+      "version number mismatched. program is %d or %d, data is %d.\n",
+       SFEX_VERSION, SFEX_VERSION_V2, cdata->version);
     return -1;
   }
-  cdata->revision = atoi ((char *) (block->revision));
-  cdata->blocksize = atoi ((char *) (block->blocksize));
-  cdata->numlocks = atoi ((char *) (block->numlocks));
+  cdata->revision = atoi ((const char *) (block->revision));
+  cdata->blocksize = atoi ((const char *) (block->blocksize));
+  cdata->numlocks = atoi ((const char *) (block->numlocks));
 
   return 0;
 }
@@ -360,8 +637,7 @@ read_controldata (sfex_controldata * cdata)
 /*
  * read_lockdata --- read lock data from file
  *
- * read sfex_lockdata from file and seek file pointer to head position of the 
- * file.
+ * read sfex_lockdata from the given position of the file.
  *
  * cdata --- pointer for control data
  *
@@ -376,23 +652,17 @@ int
 read_lockdata (const sfex_controldata * cdata, sfex_lockdata * ldata,
 	       int index)
 {
-  sfex_lockdata_ondisk *block;
+  void *block;
   int fd;
 
-  block = (sfex_lockdata_ondisk *) (locked_mem);
-
-  fd = dev_fd;
+  block = default_device.locked_mem;
 
-  /* seek a file pointer to given position */
-  if (lseek (fd, cdata->blocksize * index, SEEK_SET) == -1) {
-    cl_log(LOG_ERR, "can't seek file pointer: %s\n",
-		  strerror (errno));
-    return -1;
-  }
+  fd = default_device.fd;
 
-  /* read from file */
+  /* read from file at the position of the lock data */
   do {
-    ssize_t s = read (fd, block, cdata->blocksize);
+    ssize_t s = pread (fd, block, cdata->blocksize,
+		       (off_t) cdata->blocksize * index);
     if (s == -1) {
       if (errno == EINTR || errno == EAGAIN)
 	continue;
@@ -408,34 +678,509 @@ read_lockdata (const sfex_controldata * cdata, sfex_lockdata * ldata,
   }
   while (1);
 
-  /* read control data form buffer */
-  /* 1. check null terminator of each field 2. check the status */
-  /* We write the offset value of each field of the control data directly.
-   * Because a point using this value is limited to two places, we do not 
-   * use macro. If you chage the following offset values, you must change 
-   * values in the write_lockdata() function.
-   */
-  if (block->count[sizeof(block->count)-1] || block->nodename[sizeof(block->nodename)-1]) {
-    cl_log(LOG_ERR, "lock data format error.\n");
-    return -1;
+  return parse_lockdata (cdata, block, ldata);
+}
+
+/*
+ * parse_lockdata --- parse lock data read from file
+ *
+ * cdata --- pointer for control data, its version selects the format
+ *
+ * block --- buffer holding the on-disk lock data
+ *
+ * ldata --- pointer for lock data. Parsed lock data are stored into this
+ * pointed area.
+ */
+static int
+parse_lockdata (const sfex_controldata * cdata, const void *buf,
+		sfex_lockdata * ldata)
+{
+  if (cdata->version == SFEX_VERSION_V2) {
+    const sfex_lockdata_ondisk_v2 *block = buf;
+
+    if (get_le32 (block->crc)
+	!= block_crc (block, cdata->blocksize,
+		      offsetof (sfex_lockdata_ondisk_v2, crc))) {
+      cl_log(LOG_ERR, "lock data checksum error.\n");
+      return -1;
+    }
+    if (block->nodename[sizeof(block->nodename)-1]
+	|| block->request[sizeof(block->request)-1]) {
+      cl_log(LOG_ERR, "lock data format error.\n");
+      return -1;
+    }
+    ldata->count = get_le64 (block->generation);
+    ldata->timestamp = get_le64 (block->timestamp);
+    strncpy ((char *) (ldata->nodename), (const char *) (block->nodename), sizeof(ldata->nodename));
+    strncpy (ldata->request, (const char *) (block->request), sizeof(ldata->request));
+    ldata->status = block->status;
+  } else {
+    const sfex_lockdata_ondisk *block = buf;
+
+    /* read control data form buffer */
+    /* 1. check null terminator of each field 2. check the status */
+    /* We write the offset value of each field of the control data directly.
+     * Because a point using this value is limited to two places, we do not 
+     * use macro. If you chage the following offset values, you must change 
+     * values in the format_lockdata() function.
+     */
+    if (block->count[sizeof(block->count)-1] || block->nodename[sizeof(block->nodename)-1]) {
+      cl_log(LOG_ERR, "lock data format error.\n");
+      return -1;
+    }
+    ldata->status = block->status;
+    ldata->count = atoi ((const char *) (block->count));
+    ldata->timestamp = 0;
+    strncpy ((char *) (ldata->nodename), (const char *) (block->nodename), sizeof(ldata->nodename));
+    ldata->request[0] = 0;
   }
-  ldata->status = block->status;
   if (ldata->status != SFEX_STATUS_UNLOCK
       && ldata->status != SFEX_STATUS_LOCK) {
     cl_log(LOG_ERR, "lock data format error.\n");
     return -1;
   }
-  ldata->count = atoi ((char *) (block->count));
-  strncpy ((char *) (ldata->nodename), (const char *) (block->nodename), sizeof(ldata->nodename));
 
 #ifdef SFEX_DEBUG
   cl_log(LOG_INFO, "status: %c\n", ldata->status);
-  cl_log(LOG_INFO, "count: %d\n", ldata->count);
+  cl_log(LOG_INFO, "count: %llu\n", (unsigned long long)ldata->count);
   cl_log(LOG_INFO, "nodename: %s\n", ldata->nodename);
 #endif
   return 0;
 }
 
+/*
+ * grow_area_mem --- make the multi block buffer at least size bytes
+ */
+static int
+grow_area_mem (sfex_device * dev, size_t size)
+{
+  if (size <= dev->area_size)
+    return 0;
+
+  free (dev->area_mem);
+  dev->area_mem = NULL;
+  dev->area_size = 0;
+  if (posix_memalign (&dev->area_mem, SFEX_ODIRECT_ALIGNMENT, size) != 0) {
+    cl_log(LOG_ERR, "Failed to allocate aligned memory\n");
+    return -1;
+  }
+  dev->area_size = size;
+  return 0;
+}
+
+/*
+ * read_lockdata_range --- read adjacent lock data from file
+ *
+ * read count lock data starting at index with a single request.
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- array of count lock data. Lock data of index + i is stored
+ * into ldata[i].
+ *
+ * index --- index number of the first lock data. 1 origin.
+ *
+ * count --- number of lock data to read.
+ */
+int
+read_lockdata_range (const sfex_controldata * cdata, sfex_lockdata * ldata,
+		     int index, int count)
+{
+  return read_device_lockdata_range (&default_device, cdata, ldata,
+				     index, count);
+}
+
+/*
+ * read_device_lockdata_range --- read_lockdata_range() on the given device
+ *
+ * Different devices may be used from different threads at the same time.
+ */
+int
+read_device_lockdata_range (sfex_device * dev, const sfex_controldata * cdata,
+			    sfex_lockdata * ldata, int index, int count)
+{
+  size_t size;
+  int i;
+
+  size = cdata->blocksize * count;
+  if (grow_area_mem (dev, size) == -1)
+    return -1;
+
+  do {
+    ssize_t s = pread (dev->fd, dev->area_mem, size,
+		       (off_t) cdata->blocksize * index);
+    if (s == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+      cl_log(LOG_ERR, "can't read lockdata meta-data: %s\n",
+		    strerror (errno));
+      return -1;
+    }
+    else if (s != size) {
+      cl_log(LOG_ERR, "can't read meta-data atomically.\n");
+      return -1;
+    }
+    break;
+  }
+  while (1);
+
+  for (i = 0; i < count; i++) {
+    const uint8_t *block = (const uint8_t *) dev->area_mem
+      + cdata->blocksize * i;
+
+    if (parse_lockdata (cdata, block, &ldata[i]) == -1) {
+      cl_log(LOG_ERR, "lock data #%d is broken.\n", index + i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * write_lockdata_range --- write adjacent lock data into file
+ *
+ * write count lock data starting at index with a single request. Each
+ * block is still written completely, so a block is never torn.
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- array of count lock data. ldata[i] is written as index + i.
+ *
+ * index --- index number of the first lock data. 1 origin.
+ *
+ * count --- number of lock data to write.
+ */
+int
+write_lockdata_range (const sfex_controldata * cdata,
+		      const sfex_lockdata * ldata, int index, int count)
+{
+  return write_device_lockdata_range (&default_device, cdata, ldata,
+				      index, count);
+}
+
+/*
+ * write_device_lockdata_range --- write_lockdata_range() on the given device
+ */
+int
+write_device_lockdata_range (sfex_device * dev,
+			     const sfex_controldata * cdata,
+			     const sfex_lockdata * ldata, int index, int count)
+{
+  size_t size;
+  int i;
+
+  size = cdata->blocksize * count;
+  if (grow_area_mem (dev, size) == -1)
+    return -1;
+
+  memset (dev->area_mem, 0, size);
+  for (i = 0; i < count; i++) {
+    uint8_t *block = (uint8_t *) dev->area_mem + cdata->blocksize * i;
+
+    format_lockdata (cdata, &ldata[i], block);
+  }
+
+  do {
+    ssize_t s = pwrite (dev->fd, dev->area_mem, size,
+			(off_t) cdata->blocksize * index);
+    if (s == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+      cl_log(LOG_ERR, "can't write meta-data: %s\n",
+		    strerror (errno));
+      return -1;
+    }
+    else if (s != size) {
+      cl_log(LOG_ERR, "can't write meta-data atomically.\n");
+      return -1;
+    }
+    break;
+  }
+  while (1);
+  return 0;
+}
+
+/*
+ * read_lockarea --- read control data and all lock data from file
+ *
+ * read the whole sfex meta-data area with a single request and parse it.
+ * The buffer is kept between calls and only grown when numlocks requires.
+ *
+ * cdata --- pointer for control data. It must have been read by
+ * read_controldata() already, blocksize and numlocks give the area size.
+ * It is refreshed from the area read.
+ *
+ * ldata --- array of cdata->numlocks lock data. Lock data of index i is
+ * stored into ldata[i - 1].
+ */
+int
+read_lockarea (sfex_controldata * cdata, sfex_lockdata * ldata)
+{
+  size_t size;
+  int numlocks;
+  int i;
+
+  numlocks = cdata->numlocks;
+  size = cdata->blocksize * (numlocks + 1);
+  if (grow_area_mem (&default_device, size) == -1)
+    return -1;
+
+  do {
+    ssize_t s = pread (default_device.fd, default_device.area_mem, size, 0);
+    if (s == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+      cl_log(LOG_ERR, "can't read meta-data area: %s\n",
+		    strerror (errno));
+      return -1;
+    }
+    else if (s != size) {
+      cl_log(LOG_ERR, "can't read meta-data area: short read.\n");
+      return -1;
+    }
+    break;
+  }
+  while (1);
+
+  if (parse_controldata (default_device.area_mem, size, cdata) == -1)
+    return -1;
+  if (cdata->numlocks != numlocks) {
+    cl_log(LOG_ERR, "number of locks changed while reading.\n");
+    return -1;
+  }
+
+  for (i = 0; i < numlocks; i++) {
+    const uint8_t *block = (const uint8_t *) default_device.area_mem
+      + cdata->blocksize * (i + 1);
+
+    if (parse_lockdata (cdata, block, &ldata[i]) == -1) {
+      cl_log(LOG_ERR, "lock data #%d is broken.\n", i + 1);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * write_lockarea --- write control data and all lock data into file
+ *
+ * format the whole sfex meta-data area into one aligned buffer, write it 
+ * with a single request and flush it once. This is meant for 
+ * initialization: unlike write_lockdata(), nothing guarantees that a 
+ * large request reaches the disk atomically.
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- array of cdata->numlocks lock data. ldata[i - 1] is written 
+ * as the lock data of index i.
+ */
+int
+write_lockarea (const sfex_controldata * cdata, const sfex_lockdata * ldata)
+{
+  size_t size;
+  int i;
+
+  size = cdata->blocksize * (cdata->numlocks + 1);
+  if (grow_area_mem (&default_device, size) == -1)
+    return -1;
+
+  memset (default_device.area_mem, 0, size);
+  format_controldata (cdata, default_device.area_mem);
+  for (i = 0; i < cdata->numlocks; i++) {
+    uint8_t *block = (uint8_t *) default_device.area_mem
+      + cdata->blocksize * (i + 1);
+
+    format_lockdata (cdata, &ldata[i], block);
+  }
+
+  do {
+    ssize_t s = pwrite (default_device.fd, default_device.area_mem, size, 0);
+    if (s == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+      cl_log(LOG_ERR, "can't write meta-data area: %s\n",
+		    strerror (errno));
+      return -1;
+    }
+    else if (s != size) {
+      cl_log(LOG_ERR, "can't write meta-data area: short write.\n");
+      return -1;
+    }
+    break;
+  }
+  while (1);
+
+  if (fdatasync (default_device.fd) == -1) {
+    cl_log(LOG_ERR, "can't flush meta-data area: %s\n", strerror (errno));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * SCSI COMPARE AND WRITE (ATS)
+ *
+ * COMPARE AND WRITE compares blocks with the given data and only writes 
+ * the new data if they are equal, atomically with respect to all other 
+ * commands on the disk. It is sent with SG_IO, which addresses the whole 
+ * disk, so the LBA of a partition start is added.
+ */
+#define SFEX_CAW_OPCODE 0x89
+#define SFEX_SG_TIMEOUT 30000	/* ms */
+#define SFEX_SENSE_MISCOMPARE 0x0e
+
+/*
+ * sg_command --- send one SCSI command with SG_IO
+ *
+ * return value --- 0 on success, the sense key when the command ended 
+ * with CHECK CONDITION, -1 on other errors.
+ */
+static int
+sg_command (int fd, uint8_t * cdb, int cdb_len, int direction, void *buf,
+	    size_t len)
+{
+  struct sg_io_hdr io;
+  uint8_t sense[32];
+
+  memset (&io, 0, sizeof (io));
+  memset (sense, 0, sizeof (sense));
+  io.interface_id = 'S';
+  io.cmdp = cdb;
+  io.cmd_len = cdb_len;
+  io.dxfer_direction = direction;
+  io.dxferp = buf;
+  io.dxfer_len = len;
+  io.sbp = sense;
+  io.mx_sb_len = sizeof (sense);
+  io.timeout = SFEX_SG_TIMEOUT;
+
+  while (ioctl (fd, SG_IO, &io) == -1) {
+    if (errno == EINTR || errno == EAGAIN)
+      continue;
+    return -1;
+  }
+  if ((io.info & SG_INFO_OK_MASK) == SG_INFO_OK)
+    return 0;
+  if (io.status == 0x02 && io.sb_len_wr > 2) {	/* CHECK CONDITION */
+    /* descriptor format sense data keeps the key in byte 1 */
+    if ((sense[0] & 0x7f) >= 0x72)
+      return sense[1] & 0x0f;
+    return sense[2] & 0x0f;
+  }
+  return -1;
+}
+
+/*
+ * device_caw_supported --- check whether COMPARE AND WRITE can be used
+ *
+ * The device must be a SCSI disk or a partition of one whose Block 
+ * Limits VPD page allows writing one sfex block in a single COMPARE AND 
+ * WRITE. Regular files and other devices are reported as unsupported.
+ *
+ * return value --- 1 if supported, 0 if not.
+ */
+int
+device_caw_supported (sfex_device * dev, const sfex_controldata * cdata)
+{
+  uint8_t cdb[6] = { 0x12, 0x01, 0xb0, 0, 64, 0 };	/* INQUIRY, EVPD */
+  uint8_t vpd[64];
+  struct stat st;
+  char path[64];
+  FILE *f;
+  unsigned long long start = 0;
+
+  dev->caw_blocks = 0;
+  if (fstat (dev->fd, &st) == -1 || !S_ISBLK (st.st_mode))
+    return 0;
+  if (cdata->blocksize % dev->sector_size)
+    return 0;
+
+  memset (vpd, 0, sizeof (vpd));
+  if (sg_command (dev->fd, cdb, sizeof (cdb), SG_DXFER_FROM_DEV,
+		  vpd, sizeof (vpd)) != 0 || vpd[1] != 0xb0)
+    return 0;
+  /* MAXIMUM COMPARE AND WRITE LENGTH, 0 if not supported */
+  if (vpd[5] == 0 || vpd[5] < cdata->blocksize / dev->sector_size)
+    return 0;
+
+  /* a partition knows its start in 512 byte sectors */
+  snprintf (path, sizeof (path), "/sys/dev/block/%u:%u/start",
+	    major (st.st_rdev), minor (st.st_rdev));
+  f = fopen (path, "r");
+  if (f) {
+    if (fscanf (f, "%llu", &start) != 1)
+      start = 0;
+    fclose (f);
+  }
+
+  dev->caw_base = start * 512 / dev->sector_size;
+  dev->caw_blocks = cdata->blocksize / dev->sector_size;
+  return 1;
+}
+
+/*
+ * read_device_lockblock --- read one lock data and keep its raw block
+ *
+ * raw --- receives the block as stored, blocksize bytes. It is what 
+ * compare_and_write_lockdata() compares with.
+ */
+int
+read_device_lockblock (sfex_device * dev, const sfex_controldata * cdata,
+		       sfex_lockdata * ldata, int index, void *raw)
+{
+  if (read_device_lockdata_range (dev, cdata, ldata, index, 1) == -1)
+    return -1;
+  memcpy (raw, dev->area_mem, cdata->blocksize);
+  return 0;
+}
+
+/*
+ * compare_and_write_lockdata --- replace one lock data atomically
+ *
+ * Write ldata as lock data index only if the block still holds raw. On 
+ * success raw is replaced by the block written, ready for the next call.
+ * Only for devices device_caw_supported() accepted.
+ *
+ * return value --- 0 written, 1 the block was changed meanwhile, -1 error.
+ */
+int
+compare_and_write_lockdata (sfex_device * dev, const sfex_controldata * cdata,
+			    const sfex_lockdata * ldata, int index, void *raw)
+{
+  uint8_t cdb[16];
+  uint8_t *buf;
+  uint64_t lba;
+  size_t size = cdata->blocksize;
+  int i, ret;
+
+  if (grow_area_mem (dev, size * 2) == -1)
+    return -1;
+  buf = dev->area_mem;
+  memcpy (buf, raw, size);
+  memset (buf + size, 0, size);
+  format_lockdata (cdata, ldata, buf + size);
+
+  lba = dev->caw_base + (uint64_t) index * dev->caw_blocks;
+  memset (cdb, 0, sizeof (cdb));
+  cdb[0] = SFEX_CAW_OPCODE;
+  cdb[1] = 0x08;		/* FUA */
+  for (i = 0; i < 8; i++)
+    cdb[2 + i] = lba >> (56 - 8 * i);
+  cdb[13] = dev->caw_blocks;
+
+  ret = sg_command (dev->fd, cdb, sizeof (cdb), SG_DXFER_TO_DEV, buf,
+		    size * 2);
+  if (ret == 0) {
+    memcpy (raw, buf + size, size);
+    return 0;
+  }
+  if (ret == SFEX_SENSE_MISCOMPARE)
+    return 1;
+  cl_log(LOG_ERR, "COMPARE AND WRITE of lock data #%d failed (%d).\n",
+		index, ret);
+  return -1;
+}
+
 /*
  * lock_index_check --- check the value of index
  *
@@ -470,5 +1215,28 @@ lock_index_check(sfex_controldata * cdata, int index)
                 cl_log(LOG_ERR, "sector_size is not the same as the blocksize.\n");
                 return -1;
         }
+
+        if (nodename && check_nodename(cdata, nodename) == -1)
+                return -1;
+        return 0;
+}
+
+/*
+ * check_nodename --- check that a node name fits the lock data
+ *
+ * Version 2 lock blocks have shorter nodename and request fields than 
+ * version 1, a longer name would be cut when written.
+ *
+ * return value --- 0 if it fits, -1 if not
+ */
+int
+check_nodename(const sfex_controldata * cdata, const char *nodename)
+{
+        if (cdata->version == SFEX_VERSION_V2
+            && strlen(nodename) > SFEX_MAX_NODENAME_V2) {
+                cl_log(LOG_ERR, "nodename %s is too long for version %d meta-data. must be less than %lu byte.\n",
+                                nodename, SFEX_VERSION_V2, (unsigned long)SFEX_MAX_NODENAME_V2);
+                return -1;
+        }
         return 0;
 }
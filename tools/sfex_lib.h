@@ -28,15 +28,33 @@
 #ifndef LIB_H
 #define LIB_H
 
+/* an opened meta-data device, see open_device() */
+typedef struct sfex_device sfex_device;
+
 const char *get_progname(const char *argv0);
 char *get_nodename(void);
-void init_controldata(sfex_controldata *cdata, size_t blocksize, int numlocks);
+void init_controldata(sfex_controldata *cdata, size_t blocksize, int numlocks, int version);
 void init_lockdata(sfex_lockdata *ldata);
+uint64_t next_lockcount(const sfex_controldata *cdata, uint64_t count);
 void write_controldata(const sfex_controldata *cdata);
 int write_lockdata(const sfex_controldata *cdata, const sfex_lockdata *ldata, int index);
 int read_controldata(sfex_controldata *cdata);
 int read_lockdata(const sfex_controldata *cdata, sfex_lockdata *ldata, int index);
+int read_lockarea(sfex_controldata *cdata, sfex_lockdata *ldata);
+int write_lockarea(const sfex_controldata *cdata, const sfex_lockdata *ldata);
+int read_lockdata_range(const sfex_controldata *cdata, sfex_lockdata *ldata, int index, int count);
+int write_lockdata_range(const sfex_controldata *cdata, const sfex_lockdata *ldata, int index, int count);
 int prepare_lock(const char *device);
+sfex_device *open_device(const char *device);
+void close_device(sfex_device *dev);
+unsigned long device_sector_size(const sfex_device *dev);
+int device_caw_supported(sfex_device *dev, const sfex_controldata *cdata);
+int read_device_lockblock(sfex_device *dev, const sfex_controldata *cdata, sfex_lockdata *ldata, int index, void *raw);
+int compare_and_write_lockdata(sfex_device *dev, const sfex_controldata *cdata, const sfex_lockdata *ldata, int index, void *raw);
+int read_device_controldata(sfex_device *dev, sfex_controldata *cdata);
+int read_device_lockdata_range(sfex_device *dev, const sfex_controldata *cdata, sfex_lockdata *ldata, int index, int count);
+int write_device_lockdata_range(sfex_device *dev, const sfex_controldata *cdata, const sfex_lockdata *ldata, int index, int count);
 int lock_index_check(sfex_controldata * cdata, int index);
+int check_nodename(const sfex_controldata *cdata, const char *nodename);
 
 #endif /* LIB_H */
@@ -25,13 +25,33 @@
  *
  *-------------------------------------------------------------------------
  *
- * sfex_stat [-i <index>] <device>
+ * sfex_stat [-a] [-i <index>] <device>
+ * sfex_stat -w <interval> [-a | -i <index>...] <device>
+ * sfex_stat -s <status_socket>
+ *
+ * -a --- Display all lock data stored in the meta-data. The whole meta-data
+ * area is read by one request. The exit code still refers to <index>.
  *
  * -i <index> --- The index is number of the resource that display the lock.
  * This number is specified by the integer of one or more. When two or more 
  * resources are exclusively controlled by one meta-data, this option is used. 
  * Default is 1.
  *
+ * -s <status_socket> --- Ask a running sfex_daemon started with the same 
+ * -s option instead of reading the devices. The daemon answers from 
+ * memory, so the shared disk is not accessed. The lock counts as held 
+ * while the daemon renews it in time.
+ *
+ * -w <interval> --- Watch the lock instead of displaying it once. The 
+ * device stays open and is read every <interval> msec, all watched locks 
+ * by one request, and a line is printed only when the status or the 
+ * owner of a lock changes, when its count goes back, or when a handoff 
+ * is requested. Renewals are not printed; when a holder lets go, and for 
+ * each holder when the watch is ended by SIGINT or SIGTERM, the time it 
+ * held the lock and the interval between its renewals seen by the watch 
+ * are printed. -i may be given several times to watch several locks, -a 
+ * watches all of them. The exit code is 0 once ended by a signal.
+ *
  * <device> --- This is file path which stored meta-data. It is usually 
  * expressed in "/dev/...", because it is partition on the shared disk.
  *
@@ -52,6 +72,11 @@
 #if HAVE_UNISTD_H
 #  include <unistd.h>
 #endif
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 
 #include "sfex.h"
 #include "sfex_lib.h"
@@ -95,8 +120,14 @@ print_lockdata(const sfex_lockdata *ldata, int index)
 {
   printf("lock data #%d:\n", index);
   printf("  status: %s\n", ldata->status == SFEX_STATUS_UNLOCK ? "unlock" : "lock");
-  printf("  count: %d\n", ldata->count);
+  printf("  count: %llu\n", (unsigned long long)ldata->count);
   printf("  nodename: %s\n",ldata->nodename);
+  if (ldata->timestamp)
+    printf("  timestamp: %llu.%03llu\n",
+	   (unsigned long long)(ldata->timestamp / 1000),
+	   (unsigned long long)(ldata->timestamp % 1000));
+  if (ldata->request[0])
+    printf("  request: %s\n", ldata->request);
 }
 
 /*
@@ -110,7 +141,422 @@ print_lockdata(const sfex_lockdata *ldata, int index)
  * retrun value --- void
  */
 static void usage(FILE *dist) {
-  fprintf(dist, "usage: %s [-i <index>] <device>\n", progname);
+  fprintf(dist, "usage: %s [-a] [-i <index>] <device> [<device> <device> [<device> <device>]]\n"
+	  "       %s -w <interval> [-a | -i <index>...] <device>...\n"
+	  "       %s -s <status_socket>\n", progname, progname, progname);
+}
+
+/*
+ * stat_socket --- display the status served by a running sfex_daemon
+ *
+ * The status is read from the daemon's status socket and displayed as it 
+ * is. The lock is held by own node when the daemon holds it and the last 
+ * renewal is not older than lock_timeout.
+ *
+ * exit code --- as for main(). 3 also when no daemon answers.
+ */
+static void
+stat_socket(const char *path)
+{
+  static char buf[4096];
+  struct sockaddr_un addr;
+  struct timeval tv = { 5, 0 };	/* a stopped daemon must not hang us */
+  size_t len = 0;
+  long age = -1, timeout = -1;
+  int fd, held = 0;
+  char *line;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: ERROR: status socket path %s is too long.\n",
+	    progname, path);
+    exit(4);
+  }
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1
+      || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1
+      || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "%s: ERROR: cannot connect to %s: %s\n",
+	    progname, path, strerror(errno));
+    exit(3);
+  }
+  while (len < sizeof(buf) - 1) {
+    ssize_t r = read(fd, buf + len, sizeof(buf) - 1 - len);
+    if (r == -1) {
+      if (errno == EINTR)
+	continue;
+      fprintf(stderr, "%s: ERROR: cannot read from %s: %s\n",
+	      progname, path, strerror(errno));
+      exit(3);
+    }
+    if (r == 0)
+      break;
+    len += r;
+  }
+  close(fd);
+  buf[len] = 0;
+  fputs(buf, stdout);
+
+  for (line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+    if (!strcmp(line, "state held"))
+      held = 1;
+    sscanf(line, "renewal_age_ms %ld", &age);
+    sscanf(line, "lock_timeout_ms %ld", &timeout);
+  }
+
+  if (!held || age < 0 || timeout < 0 || age > timeout) {
+    fprintf(stdout, "status is UNLOCKED.\n");
+    exit(2);
+  } else {
+    fprintf(stdout, "status is LOCKED.\n");
+    exit(0);
+  }
+}
+
+/*
+ * stat_replicas --- display a lock area replicated on several devices
+ *
+ * The devices are read one after the other and each is displayed. The 
+ * lock is held by own node when a majority of the devices say so.
+ *
+ * exit code --- as for main().
+ */
+static void
+stat_replicas(char **devices, int num_devices, int index, int show_all)
+{
+  int d, readable = 0, own = 0;
+
+  for (d = 0; d < num_devices; d++) {
+    sfex_controldata cdata;
+    sfex_lockdata *ldata;
+    sfex_device *dev;
+    int first, count, i;
+
+    printf("device %s:\n", devices[d]);
+    dev = open_device(devices[d]);
+    if (dev == NULL)
+      continue;
+    if (read_device_controldata(dev, &cdata) == -1) {
+      close_device(dev);
+      continue;
+    }
+    if (index > cdata.numlocks) {
+      fprintf(stderr, "%s: ERROR: index %d is too large. %d locks are stored on %s.\n",
+	      progname, index, cdata.numlocks, devices[d]);
+      close_device(dev);
+      continue;
+    }
+    first = show_all ? 1 : index;
+    count = show_all ? cdata.numlocks : 1;
+    ldata = calloc(count, sizeof(sfex_lockdata));
+    if (ldata == NULL) {
+      fprintf(stderr, "%s: ERROR: %s\n", progname, strerror(errno));
+      exit(3);
+    }
+    if (read_device_lockdata_range(dev, &cdata, ldata, first, count) == 0) {
+      const sfex_lockdata *l = &ldata[index - first];
+
+      print_controldata(&cdata);
+      for (i = 0; i < count; i++)
+	print_lockdata(&ldata[i], first + i);
+      readable++;
+      if (l->status == SFEX_STATUS_LOCK && !strcmp(l->nodename, nodename))
+	own++;
+    }
+    free(ldata);
+    close_device(dev);
+  }
+
+  if (readable <= num_devices / 2) {
+    fprintf(stderr, "%s: ERROR: only %d of %d devices are readable.\n",
+	    progname, readable, num_devices);
+    exit(3);
+  }
+  if (own <= num_devices / 2) {
+    fprintf(stdout, "status is UNLOCKED.\n");
+    exit(2);
+  } else {
+    fprintf(stdout, "status is LOCKED.\n");
+    exit(0);
+  }
+}
+
+/*
+ * watch_state --- what watch mode remembers about one lock
+ */
+typedef struct watch_state {
+  int seen;			/* a lock data was read before */
+  sfex_lockdata last;		/* lock data of the previous poll */
+  struct timespec since;	/* current holder took the lock */
+  struct timespec renewed;	/* count of the holder last changed */
+  unsigned long renewals;	/* count changes seen for the holder */
+  long sum_ms;			/* sum of the intervals between them */
+  long max_ms;			/* longest of those intervals */
+} watch_state;
+
+static volatile sig_atomic_t watch_stop = 0;
+
+static void
+watch_handler(int sig)
+{
+  watch_stop = 1;
+}
+
+static long
+ts_diff_ms(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1000
+    + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/*
+ * print_stamp --- start a watch mode line with the wall clock time
+ */
+static void
+print_stamp(void)
+{
+  struct timeval tv;
+  struct tm tm;
+  char buf[32];
+
+  gettimeofday(&tv, NULL);
+  localtime_r(&tv.tv_sec, &tm);
+  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+  printf("%s.%03ld ", buf, (long)tv.tv_usec / 1000);
+}
+
+/*
+ * print_state --- print status, owner and count of a lock on one line
+ *
+ * The fields are separated by single spaces, a lock nobody ever held is 
+ * shown with owner "-".
+ */
+static void
+print_state(const sfex_lockdata *l, int index)
+{
+  printf("lock #%d: %s %s count %llu", index,
+	 l->status == SFEX_STATUS_LOCK ? "lock" : "unlock",
+	 l->nodename[0] ? l->nodename : "-",
+	 (unsigned long long)l->count);
+}
+
+/*
+ * print_cadence --- print how a holder renewed the lock
+ */
+static void
+print_cadence(const watch_state *w, const struct timespec *now)
+{
+  printf("held %ld ms by %s, renewed %lu times",
+	 ts_diff_ms(&w->since, now), w->last.nodename, w->renewals);
+  if (w->renewals)
+    printf(", every %ld ms avg, %ld ms max",
+	   w->sum_ms / (long)w->renewals, w->max_ms);
+}
+
+/*
+ * watch_lock --- compare a lock with the previous poll and report changes
+ *
+ * A line is printed when the status or the owner changed, when the count 
+ * of a version 2 lock went back, and when a handoff request appeared or vanished. A count 
+ * that moves on with the same owner is a renewal and only feeds the 
+ * cadence shown when the holder lets go.
+ */
+static void
+watch_lock(watch_state *w, const sfex_lockdata *cur, int index,
+	   const struct timespec *now, int version)
+{
+  const sfex_lockdata *prev = &w->last;
+
+  if (!w->seen) {
+    print_stamp();
+    print_state(cur, index);
+    if (cur->request[0])
+      printf(", handoff requested by %s", cur->request);
+    printf("\n");
+    w->seen = 1;
+    w->since = w->renewed = *now;
+  } else if (cur->status != prev->status
+	     || strcmp(cur->nodename, prev->nodename)) {
+    print_stamp();
+    print_state(cur, index);
+    printf(", was %s %s",
+	   prev->status == SFEX_STATUS_LOCK ? "lock" : "unlock",
+	   prev->nodename[0] ? prev->nodename : "-");
+    if (prev->status == SFEX_STATUS_LOCK) {
+      printf(": ");
+      print_cadence(w, now);
+    }
+    printf("\n");
+    w->since = w->renewed = *now;
+    w->renewals = 0;
+    w->sum_ms = w->max_ms = 0;
+  } else if (cur->count != prev->count) {
+    long ms = ts_diff_ms(&w->renewed, now);
+
+    if (version == SFEX_VERSION_V2 && cur->count < prev->count) {
+      print_stamp();
+      print_state(cur, index);
+      printf(", count went back from %llu\n",
+	     (unsigned long long)prev->count);
+    }
+    if (cur->status == SFEX_STATUS_LOCK) {
+      w->renewals++;
+      w->sum_ms += ms;
+      if (ms > w->max_ms)
+	w->max_ms = ms;
+    }
+    w->renewed = *now;
+  }
+  if (w->seen && strcmp(cur->request, prev->request)
+      && (cur->request[0] || prev->request[0])) {
+    print_stamp();
+    print_state(cur, index);
+    if (cur->request[0])
+      printf(", handoff requested by %s\n", cur->request);
+    else
+      printf(", handoff request of %s cleared\n", prev->request);
+  }
+  w->last = *cur;
+}
+
+/*
+ * watch --- stream the lock state transitions of one or more locks
+ *
+ * The locks flagged in watched[], or all locks with show_all, are 
+ * watched. The devices are opened once and polled every interval milliseconds. 
+ * Each poll reads the lock data from the lowest to the highest watched 
+ * index with one request per device. With a replicated lock area, the 
+ * copy with the highest count among the devices read is taken, and a 
+ * poll on which a majority of the devices cannot be read is reported 
+ * instead. As with stat_replicas(), a minority of the devices may be 
+ * missing from the start. Only transitions are printed, see watch_lock(). 
+ * SIGINT or SIGTERM end the watch, the cadence of each holder is printed 
+ * then.
+ *
+ * exit code --- 0 - Ended by a signal. 3 - A majority of the devices 
+ * cannot be opened.
+ */
+static void
+watch(char **devices, int num_devices, char *watched, int show_all,
+      int interval)
+{
+  sfex_device *devs[5];
+  sfex_controldata cdata;
+  sfex_lockdata *ldata, *best;
+  watch_state *state;
+  struct timespec next, now;
+  struct sigaction sa;
+  int d, i, have_cdata = 0, first = 0, last = 0, count, unreadable = 0;
+  int opened = 0;
+
+  for (d = 0; d < num_devices; d++) {
+    devs[d] = open_device(devices[d]);
+    if (devs[d] == NULL)
+      continue;
+    opened++;
+    if (!have_cdata && read_device_controldata(devs[d], &cdata) == 0)
+      have_cdata = 1;
+  }
+  if (opened <= num_devices / 2) {
+    fprintf(stderr, "%s: ERROR: only %d of %d devices could be opened.\n",
+	    progname, opened, num_devices);
+    exit(3);
+  }
+  if (!have_cdata) {
+    fprintf(stderr, "%s: ERROR: no control data could be read.\n", progname);
+    exit(3);
+  }
+
+  if (show_all)
+    memset(watched + 1, 1, cdata.numlocks);
+  for (i = 1; i <= SFEX_MAX_NUMLOCKS; i++) {
+    if (!watched[i])
+      continue;
+    if (i > cdata.numlocks) {
+      fprintf(stderr, "%s: ERROR: index %d is too large. %d locks are stored.\n",
+	      progname, i, cdata.numlocks);
+      exit(3);
+    }
+    if (!first)
+      first = i;
+    last = i;
+  }
+  count = last - first + 1;
+
+  ldata = calloc(count, sizeof(sfex_lockdata));
+  best = calloc(count, sizeof(sfex_lockdata));
+  state = calloc(count, sizeof(watch_state));
+  if (ldata == NULL || best == NULL || state == NULL) {
+    fprintf(stderr, "%s: ERROR: %s\n", progname, strerror(errno));
+    exit(3);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = watch_handler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (!watch_stop) {
+    int readable = 0;
+
+    for (d = 0; d < num_devices; d++) {
+      if (devs[d] == NULL
+	  || read_device_lockdata_range(devs[d], &cdata, ldata, first, count) == -1)
+	continue;
+      for (i = 0; i < count; i++)
+	if (!readable || ldata[i].count > best[i].count)
+	  best[i] = ldata[i];
+      readable++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (readable <= num_devices / 2) {
+      if (!unreadable) {
+	print_stamp();
+	printf("lock area unreadable, %d of %d devices read\n",
+	       readable, num_devices);
+	unreadable = 1;
+      }
+    } else {
+      if (unreadable) {
+	print_stamp();
+	printf("lock area readable again\n");
+	unreadable = 0;
+      }
+      for (i = 0; i < count; i++)
+	if (watched[first + i])
+	  watch_lock(&state[i], &best[i], first + i, &now, cdata.version);
+    }
+    fflush(stdout);
+
+    /* poll on a fixed schedule, but do not catch up after a stall */
+    next.tv_nsec += (long)interval * 1000000;
+    while (next.tv_nsec >= 1000000000) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000;
+    }
+    if (ts_diff_ms(&now, &next) < 0)
+      next = now;
+    else
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (i = 0; i < count; i++) {
+    if (!state[i].seen || state[i].last.status != SFEX_STATUS_LOCK)
+      continue;
+    print_stamp();
+    print_state(&state[i].last, first + i);
+    printf(", still held: ");
+    print_cadence(&state[i], &now);
+    printf("\n");
+  }
+  fflush(stdout);
+  exit(0);
 }
 
 /*
@@ -127,11 +573,16 @@ int
 main(int argc, char *argv[]) {
   sfex_controldata cdata;
   sfex_lockdata ldata;
+  sfex_lockdata *all = NULL;
   int ret = 0;
 
   /* command line parameter */
   int index = 1;		/* default 1st lock */
+  int show_all = 0;
+  int interval = 0;		/* watch mode off */
+  static char watched[SFEX_MAX_NUMLOCKS + 1];
   const char *device;
+  const char *status_path = NULL;
 
   /*
    * startup process
@@ -148,13 +599,19 @@ main(int argc, char *argv[]) {
   /* read command line option */
   opterr = 0;
   while (1) {
-    int c = getopt(argc, argv, "hi:");
+    int c = getopt(argc, argv, "hai:s:w:");
     if (c == -1)
       break;
     switch (c) {
     case 'h':			/* help */
       usage(stdout);
       exit(0);
+    case 'a':			/* -a */
+      show_all = 1;
+      break;
+    case 's':			/* -s <status_socket> */
+      status_path = optarg;
+      break;
     case 'i':			/* -i <index> */
       {
 	unsigned long l = strtoul(optarg, NULL, 10);
@@ -167,6 +624,19 @@ main(int argc, char *argv[]) {
 	  exit(4);
 	}
 	index = l;
+	watched[l] = 1;
+      }
+      break;
+    case 'w':			/* -w <interval> */
+      {
+	unsigned long l = strtoul(optarg, NULL, 10);
+	if (l < 1 || l > 60000) {
+	  fprintf(stderr,
+		  "%s: ERROR: interval %s is out of range or invalid. it must be integer value between 1 and 60000 (msec).\n",
+		  progname, optarg);
+	  exit(4);
+	}
+	interval = l;
       }
       break;
     case '?':			/* error */
@@ -175,13 +645,23 @@ main(int argc, char *argv[]) {
     }
   }
 
+  if (status_path) {
+    if (optind < argc || interval) {
+      fprintf(stderr, "%s: ERROR: no device and no -w may be given with -s.\n", progname);
+      usage(stderr);
+      exit(4);
+    }
+    stat_socket(status_path);
+  }
+
   /* check parameter except the option */
   if (optind >= argc) {
     fprintf(stderr, "%s: ERROR: no device specified.\n", progname);
     usage(stderr);
     exit(4);
-  } else if (optind + 1 < argc) {
-    fprintf(stderr, "%s: ERROR: too many arguments.\n", progname);
+  } else if (argc - optind != 1 && argc - optind != 3 && argc - optind != 5) {
+    fprintf(stderr, "%s: ERROR: %d devices given, 1, 3 or 5 devices are needed.\n",
+	    progname, argc - optind);
     usage(stderr);
     exit(4);
   }
@@ -191,21 +671,49 @@ main(int argc, char *argv[]) {
    * main processes start 
    */
 
+  if (interval) {
+    if (!show_all)
+      watched[index] = 1;
+    watch(&argv[optind], argc - optind, watched, show_all, interval);
+  }
+
   /* get a node name */
   nodename = get_nodename();
 
+  if (argc - optind > 1)
+    stat_replicas(&argv[optind], argc - optind, index, show_all);
+
   prepare_lock(device);
 
   ret = lock_index_check(&cdata, index);
   if (ret == -1)
     exit(EXIT_FAILURE);
 
-  /* read lock data */
-  read_lockdata(&cdata, &ldata, index);
+  if (show_all) {
+    int i;
+
+    /* read control data and all lock data at once */
+    all = calloc(cdata.numlocks, sizeof(sfex_lockdata));
+    if (all == NULL) {
+      fprintf(stderr, "%s: ERROR: %s\n", progname, strerror(errno));
+      exit(3);
+    }
+    if (read_lockarea(&cdata, all) == -1)
+      exit(3);
+    ldata = all[index - 1];
+
+    /* display status */
+    print_controldata(&cdata);
+    for (i = 1; i <= cdata.numlocks; i++)
+      print_lockdata(&all[i - 1], i);
+  } else {
+    /* read lock data */
+    read_lockdata(&cdata, &ldata, index);
 
-  /* display status */
-  print_controldata(&cdata);
-  print_lockdata(&ldata, index);
+    /* display status */
+    print_controldata(&cdata);
+    print_lockdata(&ldata, index);
+  }
 
   /* check current lock status */
   if (ldata.status != SFEX_STATUS_LOCK || strcmp(ldata.nodename, nodename)) {
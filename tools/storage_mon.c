@@ -2,12 +2,17 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
 #include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
@@ -40,6 +45,10 @@
 #define SMON_MAX_IPCSNAME 256
 #define SMON_MAX_MSGSIZE 128
 #define SMON_MAX_RESP_SIZE 100
+#define SMON_LATENCY_BUCKETS 10
+#define SMON_UPGRADE_ENV "STORAGE_MON_UPGRADE_FD"
+#define SMON_STATE_MAGIC 0x534d4f4e
+#define SMON_STATE_VERSION 1
 
 #define PRINT_STORAGE_MON_ERR(fmt, ...) if (!daemonize) { \
 					fprintf(stderr, fmt"\n", __VA_ARGS__); \
@@ -62,6 +71,42 @@ struct storage_mon_timer_data {
 	int interval;
 };
 
+/* Per-device counters exported through --metrics-file */
+struct storage_mon_device_stats {
+	uint64_t latency_buckets[SMON_LATENCY_BUCKETS];
+	uint64_t latency_count;
+	double latency_sum;
+	uint64_t errors;
+	uint64_t timeouts;
+	uint64_t late;
+	int stuck;
+};
+
+/* Worker thread running the tests of one device for --probe-mode thread */
+struct storage_mon_probe {
+	pthread_t thread;
+	size_t index;
+	gboolean busy;		/* only used from the main loop */
+	int requested;		/* the fields below are protected by probe_lock */
+	int completed;
+	int result;
+	uint64_t latency_ns;
+};
+
+/* Results carried over to the new binary by an in place upgrade */
+struct storage_mon_saved_state {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	int final_score;
+	int response_final_score;
+	int daemon_check_first_all_devices;
+	uint64_t rounds_total;
+	double round_duration;
+	uint32_t device_count;
+	struct storage_mon_device_stats device_stats[MAX_DEVICES];
+};
+
 struct storage_mon_check_value_req {
 	struct qb_ipc_request_header hdr;
 	char message[SMON_MAX_MSGSIZE];
@@ -89,6 +134,27 @@ int response_final_score = 0;
 pid_t test_forks[MAX_DEVICES];
 size_t finished_count = 0;
 gboolean daemon_check_first_all_devices = FALSE;
+const char *metrics_file = NULL;
+struct storage_mon_device_stats device_stats[MAX_DEVICES];
+struct timespec test_start[MAX_DEVICES];
+struct timespec round_start;
+double round_duration = 0;
+uint64_t rounds_total = 0;
+gboolean round_reported = TRUE;
+gboolean probe_threads = FALSE;
+static struct storage_mon_probe probes[MAX_DEVICES];
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probe_cond = PTHREAD_COND_INITIALIZER;
+static int probe_threads_stop = 0;
+static int probe_efd = -1;
+gboolean upgrade_requested = FALSE;
+gboolean upgrade_resumed = FALSE;
+char **saved_argv;
+
+/* Upper bounds (in seconds) of the probe latency histogram buckets, +Inf is implied */
+static const double latency_bounds[SMON_LATENCY_BUCKETS] = {
+	0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.5, 1, 5
+};
 
 static qb_loop_t *storage_mon_poll_handle;
 static qb_loop_timer_handle timer_handle;
@@ -97,6 +163,7 @@ static struct storage_mon_timer_data timer_d;
 
 static int test_device_main(gpointer data);
 static void wrap_test_device_main(void *data);
+static void upgrade_daemon(void);
 
 static void usage(char *name, FILE *f)
 {
@@ -110,12 +177,15 @@ static void usage(char *name, FILE *f)
 	fprintf(f, "      --interval <n>       interval to test. in seconds (default %d)(for daemonize only)\n", DEFAULT_INTERVAL);
 	fprintf(f, "      --pidfile <path>     file path to record pid (default %s)(for daemonize only)\n", DEFAULT_PIDFILE);
 	fprintf(f, "      --attrname <attr>    attribute name to update test result (default %s)(for daemonize/client only)\n", DEFAULT_ATTRNAME);
+	fprintf(f, "      --metrics-file <path> file to rewrite with Prometheus text format metrics after each test (for daemonize only)\n");
+	fprintf(f, "      --probe-mode <mode>  run device tests in a forked process (fork, default) or on a worker thread (thread)(for daemonize only)\n");
 	fprintf(f, "      --verbose        emit extra output to stdout\n");
 	fprintf(f, "      --help           print this message\n");
+	fprintf(f, "   A daemon receiving SIGHUP re-executes itself in place, keeping its last results.\n");
 }
 
-/* Check one device */
-static void *test_device(const char *device, int verbose, int inject_error_percent)
+/* Check one device, returns 0 on success and -1 on failure */
+static int test_device(const char *device, int verbose, int inject_error_percent, unsigned int *seed)
 {
 	uint64_t devsize;
 	int flags = O_RDONLY | O_DIRECT;
@@ -131,13 +201,13 @@ static void *test_device(const char *device, int verbose, int inject_error_perce
 	if (device_fd < 0) {
 		if (errno != EINVAL) {
 			PRINT_STORAGE_MON_ERR("Failed to open %s: %s", device, strerror(errno));
-			exit(-1);
+			return -1;
 		}
 		flags &= ~O_DIRECT;
 		device_fd = open(device, flags);
 		if (device_fd < 0) {
 			PRINT_STORAGE_MON_ERR("Failed to open %s: %s", device, strerror(errno));
-			exit(-1);
+			return -1;
 		}
 	}
 #ifdef __FreeBSD__
@@ -153,15 +223,8 @@ static void *test_device(const char *device, int verbose, int inject_error_perce
 		PRINT_STORAGE_MON_INFO("%s: opened %s O_DIRECT, size=%zu", device, (flags & O_DIRECT)?"with":"without", devsize);
 	}
 
-	/* Don't fret about real randomness */
-	srand(time(NULL) + getpid());
 	/* Pick a random place on the device - sector aligned */
-	seek_spot = (rand() % (devsize-1024)) & 0xFFFFFFFFFFFFFE00;
-	res = lseek(device_fd, seek_spot, SEEK_SET);
-	if (res < 0) {
-		PRINT_STORAGE_MON_ERR("Failed to seek %s: %s", device, strerror(errno));
-		goto error;
-	}
+	seek_spot = (rand_r(seed) % (devsize-1024)) & 0xFFFFFFFFFFFFFE00;
 	if (verbose) {
 		PRINT_STORAGE_MON_INFO("%s: reading from pos %ld", device, seek_spot);
 	}
@@ -184,7 +247,7 @@ static void *test_device(const char *device, int verbose, int inject_error_perce
 			PRINT_STORAGE_MON_ERR("Failed to allocate aligned memory: %s", strerror(errno));
 			goto error;
 		}
-		res = read(device_fd, buffer, sec_size);
+		res = pread(device_fd, buffer, sec_size, seek_spot);
 		free(buffer);
 		if (res < 0) {
 			PRINT_STORAGE_MON_ERR("Failed to read %s: %s", device, strerror(errno));
@@ -197,7 +260,7 @@ static void *test_device(const char *device, int verbose, int inject_error_perce
 	} else {
 		char buffer[512];
 
-		res = read(device_fd, buffer, sizeof(buffer));
+		res = pread(device_fd, buffer, sizeof(buffer), seek_spot);
 		if (res < 0) {
 			PRINT_STORAGE_MON_ERR("Failed to read %s: %s", device, strerror(errno));
 			goto error;
@@ -209,24 +272,24 @@ static void *test_device(const char *device, int verbose, int inject_error_perce
 	}
 
 	/* Fake an error */
-	if (inject_error_percent && ((rand() % 100) < inject_error_percent)) {
+	if (inject_error_percent && ((rand_r(seed) % 100) < inject_error_percent)) {
 		PRINT_STORAGE_MON_ERR_NOARGS("People, please fasten your seatbelts, injecting errors!");
 		goto error;
 	}
 	res = close(device_fd);
 	if (res != 0) {
 		PRINT_STORAGE_MON_ERR("Failed to close %s: %s", device, strerror(errno));
-		exit(-1);
+		return -1;
 	}
 
 	if (verbose) {
 		PRINT_STORAGE_MON_INFO("%s: done", device);
 	}
-	exit(0);
+	return 0;
 
 error:
 	close(device_fd);
-	exit(-1);
+	return -1;
 }
 
 static gboolean is_child_runnning(void)
@@ -234,7 +297,7 @@ static gboolean is_child_runnning(void)
 	size_t i;
 
 	for (i=0; i<device_count; i++) {
-		if (test_forks[i] != 0) {
+		if (test_forks[i] != 0 || probes[i].busy) {
 			return TRUE;
 		}
 	}
@@ -252,6 +315,179 @@ static void stop_child(pid_t pid, int signal)
    	}
 }
 
+static double elapsed_seconds(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void record_probe_latency(size_t index, double latency)
+{
+	struct storage_mon_device_stats *st = &device_stats[index];
+	int b;
+
+	for (b = 0; b < SMON_LATENCY_BUCKETS; b++) {
+		if (latency <= latency_bounds[b]) {
+			st->latency_buckets[b]++;
+		}
+	}
+	st->latency_count++;
+	st->latency_sum += latency;
+}
+
+/* Escape a device path for use as a label value */
+static void print_label_value(FILE *f, const char *value)
+{
+	for (; *value; value++) {
+		if (*value == '\\' || *value == '"') {
+			fputc('\\', f);
+		}
+		fputc(*value, f);
+	}
+}
+
+#define PRINT_DEVICE_LABEL(f, i) do { \
+		fputs("{device=\"", f); \
+		print_label_value(f, devices[i]); \
+		fputs("\"", f); \
+	} while (0)
+
+/* Rewrite the metrics file atomically: readers only ever see a complete file. */
+static void write_metrics_file(void)
+{
+	char *tmpfile = NULL;
+	FILE *f;
+	size_t i;
+	int b;
+
+	if (metrics_file == NULL) {
+		return;
+	}
+
+	if (asprintf(&tmpfile, "%s.tmp", metrics_file) < 0) {
+		syslog(LOG_ERR, "Failed to allocate memory for metrics file name");
+		return;
+	}
+
+	f = fopen(tmpfile, "w");
+	if (f == NULL) {
+		syslog(LOG_ERR, "Failed to open %s: %s", tmpfile, strerror(errno));
+		free(tmpfile);
+		return;
+	}
+
+	fprintf(f, "# HELP storage_mon_probe_duration_seconds Time taken by a device read test.\n");
+	fprintf(f, "# TYPE storage_mon_probe_duration_seconds histogram\n");
+	for (i=0; i<device_count; i++) {
+		for (b = 0; b < SMON_LATENCY_BUCKETS; b++) {
+			fputs("storage_mon_probe_duration_seconds_bucket", f);
+			PRINT_DEVICE_LABEL(f, i);
+			fprintf(f, ",le=\"%g\"} %" PRIu64 "\n", latency_bounds[b], device_stats[i].latency_buckets[b]);
+		}
+		fputs("storage_mon_probe_duration_seconds_bucket", f);
+		PRINT_DEVICE_LABEL(f, i);
+		fprintf(f, ",le=\"+Inf\"} %" PRIu64 "\n", device_stats[i].latency_count);
+		fputs("storage_mon_probe_duration_seconds_sum", f);
+		PRINT_DEVICE_LABEL(f, i);
+		fprintf(f, "} %.9f\n", device_stats[i].latency_sum);
+		fputs("storage_mon_probe_duration_seconds_count", f);
+		PRINT_DEVICE_LABEL(f, i);
+		fprintf(f, "} %" PRIu64 "\n", device_stats[i].latency_count);
+	}
+
+	fprintf(f, "# HELP storage_mon_probe_errors_total Device read tests that failed.\n");
+	fprintf(f, "# TYPE storage_mon_probe_errors_total counter\n");
+	for (i=0; i<device_count; i++) {
+		fputs("storage_mon_probe_errors_total", f);
+		PRINT_DEVICE_LABEL(f, i);
+		fprintf(f, "} %" PRIu64 "\n", device_stats[i].errors);
+	}
+
+	fprintf(f, "# HELP storage_mon_probe_timeouts_total Device read tests that did not complete within the timeout.\n");
+	fprintf(f, "# TYPE storage_mon_probe_timeouts_total counter\n");
+	for (i=0; i<device_count; i++) {
+		fputs("storage_mon_probe_timeouts_total", f);
+		PRINT_DEVICE_LABEL(f, i);
+		fprintf(f, "} %" PRIu64 "\n", device_stats[i].timeouts);
+	}
+
+	fprintf(f, "# HELP storage_mon_probe_late_total Device read tests that completed after the timeout.\n");
+	fprintf(f, "# TYPE storage_mon_probe_late_total counter\n");
+	for (i=0; i<device_count; i++) {
+		fputs("storage_mon_probe_late_total", f);
+		PRINT_DEVICE_LABEL(f, i);
+		fprintf(f, "} %" PRIu64 "\n", device_stats[i].late);
+	}
+
+	fprintf(f, "# HELP storage_mon_probe_stuck Whether a timed out device read test is still running.\n");
+	fprintf(f, "# TYPE storage_mon_probe_stuck gauge\n");
+	for (i=0; i<device_count; i++) {
+		fputs("storage_mon_probe_stuck", f);
+		PRINT_DEVICE_LABEL(f, i);
+		fprintf(f, "} %d\n", device_stats[i].stuck);
+	}
+
+	fprintf(f, "# HELP storage_mon_round_duration_seconds Time taken by the last round of device tests.\n");
+	fprintf(f, "# TYPE storage_mon_round_duration_seconds gauge\n");
+	fprintf(f, "storage_mon_round_duration_seconds %.9f\n", round_duration);
+	fprintf(f, "# HELP storage_mon_rounds_total Rounds of device tests completed.\n");
+	fprintf(f, "# TYPE storage_mon_rounds_total counter\n");
+	fprintf(f, "storage_mon_rounds_total %" PRIu64 "\n", rounds_total);
+	fprintf(f, "# HELP storage_mon_score Aggregate score reported to clients.\n");
+	fprintf(f, "# TYPE storage_mon_score gauge\n");
+	fprintf(f, "storage_mon_score %d\n", final_score);
+
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+		syslog(LOG_ERR, "Failed to write %s: %s", tmpfile, strerror(errno));
+		fclose(f);
+		unlink(tmpfile);
+		free(tmpfile);
+		return;
+	}
+	fclose(f);
+
+	if (rename(tmpfile, metrics_file) < 0) {
+		syslog(LOG_ERR, "Failed to rename %s to %s: %s", tmpfile, metrics_file, strerror(errno));
+		unlink(tmpfile);
+	}
+	free(tmpfile);
+}
+
+/* The upgrade waits for tests still running, which a device stuck in I/O
+   can hold up indefinitely: tell which ones each time a round ends */
+static void log_upgrade_deferred(void)
+{
+	size_t i;
+
+	for (i=0; i<device_count; i++) {
+		if (test_forks[i] != 0 || probes[i].busy) {
+			syslog(LOG_WARNING, "Upgrade deferred, test of device %s still running after %.1f seconds",
+			       devices[i], elapsed_seconds(&test_start[i]));
+		}
+	}
+}
+
+/* Called when every test of a round has finished or the round timed out */
+static void finish_round(void)
+{
+	if (!round_reported) {
+		round_duration = elapsed_seconds(&round_start);
+		rounds_total++;
+		round_reported = TRUE;
+	}
+	write_metrics_file();
+
+	if (upgrade_requested) {
+		if (is_child_runnning()) {
+			log_upgrade_deferred();
+		} else {
+			upgrade_daemon();
+		}
+	}
+}
+
 static int32_t sigterm_handler(int num, void *data)
 {
 	size_t i;
@@ -291,6 +527,44 @@ static size_t find_child_pid(int pid)
 	return -1;
 }
 
+/* Account for the result of a device test, whether it ran in a child or on a worker thread */
+static void test_finished(size_t index, gboolean failed, double latency)
+{
+	record_probe_latency(index, latency);
+	if (failed) {
+		device_stats[index].errors++;
+	}
+	if (device_stats[index].stuck) {
+		/* Timed out already, but still worth knowing how slow the device was */
+		syslog(LOG_WARNING, "Reading from device %s completed late after %.3f seconds", devices[index], latency);
+		device_stats[index].late++;
+		device_stats[index].stuck = 0;
+	}
+
+	/* If the expire timer is running, no timeout has occurred, 			*/
+	/* so add the final_score from the result of the finished test. 	*/
+	if (qb_loop_timer_is_running(storage_mon_poll_handle, expire_handle)) { 
+		if (failed) {
+			syslog(LOG_ERR, "Error reading from device %s", devices[index]);
+
+			final_score += scores[index];
+
+			/* Update response values immediately in preparation for inquiries from clients. */
+			response_final_score = final_score;
+
+			/* Even in the first demon mode check, if there is an error device, clear */
+			/* the flag to return the response to the client without waiting for all devices to finish. */
+			daemon_check_first_all_devices = TRUE;
+		}
+	}
+
+	finished_count++;
+
+	if (finished_count == device_count) {
+		finish_round();
+	}
+}
+
 static int32_t sigchld_handler(int32_t sig, void *data)
 {
 	pid_t pid;
@@ -303,27 +577,10 @@ static int32_t sigchld_handler(int32_t sig, void *data)
 			if (pid > 0) {
 				if (WIFEXITED(status)) {
 					index = find_child_pid(pid);
-					if (index >= 0) {
-						/* If the expire timer is running, no timeout has occurred, 			*/
-						/* so add the final_score from the exit code of the terminated child process. 	*/
-						if (qb_loop_timer_is_running(storage_mon_poll_handle, expire_handle)) { 
-							if (WEXITSTATUS(status) !=0) {
-								syslog(LOG_ERR, "Error reading from device %s", devices[index]);
-
-								final_score += scores[index];
-
-								/* Update response values immediately in preparation for inquiries from clients. */
-								response_final_score = final_score;
-
-								/* Even in the first demon mode check, if there is an error device, clear */
-								/* the flag to return the response to the client without waiting for all devices to finish. */
-								daemon_check_first_all_devices = TRUE;
-							}
-						}
-
-						finished_count++;
+					if (index != (size_t)-1) {
 						test_forks[index] = 0;
-					
+						test_finished(index, WEXITSTATUS(status) != 0,
+							      elapsed_seconds(&test_start[index]));
 					}
 				}
 			} else {
@@ -404,9 +661,12 @@ static void child_timeout_handler(void *data)
 
 	if (is_child_runnning()) {
 		for (i=0; i<device_count; i++) {
-			if (test_forks[i] > 0) {
+			if (test_forks[i] > 0 || probes[i].busy) {
 				syslog(LOG_ERR, "Reading from device %s did not complete in %d seconds timeout", devices[i], timeout);
 
+				device_stats[i].timeouts++;
+				device_stats[i].stuck = 1;
+
 				/* If timeout occurs before SIGCHLD, add child process failure score to final_score. */
 				final_score += scores[i];
 
@@ -418,9 +678,127 @@ static void child_timeout_handler(void *data)
 				daemon_check_first_all_devices = TRUE;
 			}
 		}
+		finish_round();
 	}
 }
 
+static void *probe_thread_main(void *data)
+{
+	struct storage_mon_probe *probe = (struct storage_mon_probe *)data;
+	unsigned int seed = time(NULL) + getpid() + probe->index;
+	struct timespec start, end;
+	uint64_t one = 1;
+	int rc;
+
+	while (1) {
+		pthread_mutex_lock(&probe_lock);
+		while (!probe->requested && !probe_threads_stop) {
+			pthread_cond_wait(&probe_cond, &probe_lock);
+		}
+		if (probe_threads_stop) {
+			pthread_mutex_unlock(&probe_lock);
+			break;
+		}
+		probe->requested = 0;
+		pthread_mutex_unlock(&probe_lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		rc = test_device(devices[probe->index], verbose, inject_error_percent, &seed);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		pthread_mutex_lock(&probe_lock);
+		probe->result = rc;
+		probe->latency_ns = (uint64_t)(end.tv_sec - start.tv_sec) * QB_TIME_NS_IN_SEC
+			+ end.tv_nsec - start.tv_nsec;
+		probe->completed = 1;
+		pthread_mutex_unlock(&probe_lock);
+
+		/* Wake up the main loop, see probe_result_dispatch() */
+		if (write(probe_efd, &one, sizeof(one)) < 0) {
+			syslog(LOG_ERR, "Failed to notify result for device %s: %s", devices[probe->index], strerror(errno));
+		}
+	}
+	return NULL;
+}
+
+static int32_t probe_result_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	uint64_t events;
+	size_t i;
+
+	if (read(fd, &events, sizeof(events)) < 0 && errno != EAGAIN) {
+		syslog(LOG_ERR, "Failed to read probe results: %s", strerror(errno));
+	}
+
+	for (i=0; i<device_count; i++) {
+		int completed, result;
+		uint64_t latency_ns;
+
+		pthread_mutex_lock(&probe_lock);
+		completed = probes[i].completed;
+		result = probes[i].result;
+		latency_ns = probes[i].latency_ns;
+		probes[i].completed = 0;
+		pthread_mutex_unlock(&probe_lock);
+
+		if (completed) {
+			probes[i].busy = FALSE;
+			test_finished(i, result != 0, (double)latency_ns / QB_TIME_NS_IN_SEC);
+		}
+	}
+	return 0;
+}
+
+static void start_probe(size_t index)
+{
+	probes[index].busy = TRUE;
+
+	pthread_mutex_lock(&probe_lock);
+	probes[index].requested = 1;
+	pthread_cond_broadcast(&probe_cond);
+	pthread_mutex_unlock(&probe_lock);
+}
+
+static int start_probe_threads(void)
+{
+	sigset_t all, old;
+	size_t i;
+	int rc;
+
+	probe_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (probe_efd < 0) {
+		syslog(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+		return -1;
+	}
+	qb_loop_poll_add(storage_mon_poll_handle, QB_LOOP_MED, probe_efd, POLLIN,
+		NULL, probe_result_dispatch);
+
+	/* Signals are for the main loop only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i=0; i<device_count; i++) {
+		probes[i].index = i;
+		rc = pthread_create(&probes[i].thread, NULL, probe_thread_main, &probes[i]);
+		if (rc != 0) {
+			syslog(LOG_ERR, "Failed to create probe thread for %s: %s", devices[i], strerror(rc));
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			return -1;
+		}
+		pthread_detach(probes[i].thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return 0;
+}
+
+/* Idle workers exit, a worker stuck on a hung device is left behind */
+static void stop_probe_threads(void)
+{
+	pthread_mutex_lock(&probe_lock);
+	probe_threads_stop = 1;
+	pthread_cond_broadcast(&probe_cond);
+	pthread_mutex_unlock(&probe_lock);
+}
+
 static void wrap_test_device_main(void *data)
 {
 	struct storage_mon_timer_data *timer_data = (struct storage_mon_timer_data*)data;
@@ -461,7 +839,14 @@ static int test_device_main(gpointer data)
 		finished_count = 0;
 
 		memset(test_forks, 0, sizeof(test_forks));
+		clock_gettime(CLOCK_MONOTONIC, &round_start);
+		round_reported = FALSE;
 		for (i=0; i<device_count; i++) {
+			clock_gettime(CLOCK_MONOTONIC, &test_start[i]);
+			if (probe_threads) {
+				start_probe(i);
+				continue;
+			}
 			test_forks[i] = fork();
 			if (test_forks[i] < 0) {
 				PRINT_STORAGE_MON_ERR("Error spawning fork for %s: %s\n", devices[i], strerror(errno));
@@ -470,10 +855,13 @@ static int test_device_main(gpointer data)
 			}
 			/* child */
 			if (test_forks[i] == 0) {
+				unsigned int seed;
+
 				if (daemonize) {
 					signal(SIGTERM, &child_shutdown);
 				}
-				test_device(devices[i], verbose, inject_error_percent);
+				seed = time(NULL) + getpid();
+				exit(test_device(devices[i], verbose, inject_error_percent, &seed));
 			}
 		}
 
@@ -702,38 +1090,27 @@ storage_mon_client(void)
 	return(rc);
 }
 
+static struct qb_ipcs_service_handlers service_handle = {
+	.connection_accept = storage_mon_ipcs_connection_accept_fn,
+	.connection_created = storage_mon_ipcs_connection_created_fn,
+	.msg_process = storage_mon_ipcs_msg_process_fn,
+	.connection_destroyed = storage_mon_ipcs_connection_destroyed_fn,
+	.connection_closed = storage_mon_ipcs_connection_closed_fn,
+};
+
+static struct qb_ipcs_poll_handlers poll_handle = {
+	.job_add = storage_mon_job_add,
+	.dispatch_add = storage_mon_dispatch_add,
+	.dispatch_mod = storage_mon_dispatch_mod,
+	.dispatch_del = storage_mon_dispatch_del,
+};
+
 static int32_t
-storage_mon_daemon(int interval, const char *pidfile)
+storage_mon_ipcs_start(void)
 {
 	int32_t rc;
 	char ipcs_name[SMON_MAX_IPCSNAME];
 
-	struct qb_ipcs_service_handlers service_handle = {
-		.connection_accept = storage_mon_ipcs_connection_accept_fn,
-		.connection_created = storage_mon_ipcs_connection_created_fn,
-		.msg_process = storage_mon_ipcs_msg_process_fn,
-		.connection_destroyed = storage_mon_ipcs_connection_destroyed_fn,
-		.connection_closed = storage_mon_ipcs_connection_closed_fn,
-	};
-
-	struct qb_ipcs_poll_handlers poll_handle = {
-		.job_add = storage_mon_job_add,
-		.dispatch_add = storage_mon_dispatch_add,
-		.dispatch_mod = storage_mon_dispatch_mod,
-		.dispatch_del = storage_mon_dispatch_del,
-	};
-
-	if (daemon(0, 0) < 0) {
-		syslog(LOG_ERR, "Failed to daemonize: %s", strerror(errno));
-		return -1;
-	}
-
-	umask(S_IWGRP | S_IWOTH | S_IROTH);
-
-	if (write_pid_file(pidfile) < 0) {
-		return -1;
-	}
-
 	snprintf(ipcs_name, SMON_MAX_IPCSNAME, "storage_mon_%s", attrname);
 	ipcs = qb_ipcs_create(ipcs_name, 0, QB_IPC_NATIVE, &service_handle);
 	if (ipcs == 0) {
@@ -743,8 +1120,6 @@ storage_mon_daemon(int interval, const char *pidfile)
 
 	qb_ipcs_enforce_buffer_size(ipcs, SMON_BUFF_1MEG);
 
-	storage_mon_poll_handle = qb_loop_create();
-
 	qb_ipcs_poll_handlers_set(ipcs, &poll_handle);
 	rc = qb_ipcs_run(ipcs);
 	if (rc != 0) {
@@ -752,6 +1127,151 @@ storage_mon_daemon(int interval, const char *pidfile)
 		syslog(LOG_ERR, "qb_ipcs_run");
 		return -1;
 	}
+	return 0;
+}
+
+/* Hand the last results to the new binary through an unlinked temporary file */
+static int save_state(void)
+{
+	struct storage_mon_saved_state state;
+	FILE *f;
+	int fd;
+
+	memset(&state, 0, sizeof(state));
+	state.magic = SMON_STATE_MAGIC;
+	state.version = SMON_STATE_VERSION;
+	state.size = sizeof(state);
+	state.final_score = final_score;
+	state.response_final_score = response_final_score;
+	state.daemon_check_first_all_devices = daemon_check_first_all_devices;
+	state.rounds_total = rounds_total;
+	state.round_duration = round_duration;
+	state.device_count = device_count;
+	memcpy(state.device_stats, device_stats, sizeof(state.device_stats));
+
+	f = tmpfile();
+	if (f == NULL) {
+		syslog(LOG_ERR, "Failed to create upgrade state file: %s", strerror(errno));
+		return -1;
+	}
+	if (fwrite(&state, sizeof(state), 1, f) != 1 || fflush(f) != 0) {
+		syslog(LOG_ERR, "Failed to write upgrade state: %s", strerror(errno));
+		fclose(f);
+		return -1;
+	}
+
+	/* Keep a plain descriptor, it is not close-on-exec */
+	fd = dup(fileno(f));
+	fclose(f);
+	if (fd < 0) {
+		syslog(LOG_ERR, "Failed to duplicate upgrade state fd: %s", strerror(errno));
+		return -1;
+	}
+	return fd;
+}
+
+static void restore_state(void)
+{
+	struct storage_mon_saved_state state;
+	const char *env = getenv(SMON_UPGRADE_ENV);
+	int fd;
+
+	if (env == NULL) {
+		return;
+	}
+	fd = atoi(env);
+	unsetenv(SMON_UPGRADE_ENV);
+	/* Even without usable results, the previous daemon is already detached */
+	upgrade_resumed = TRUE;
+
+	if (pread(fd, &state, sizeof(state), 0) != sizeof(state)) {
+		syslog(LOG_ERR, "Failed to read upgrade state: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	if (state.magic != SMON_STATE_MAGIC || state.version != SMON_STATE_VERSION
+	    || state.size != sizeof(state) || state.device_count != device_count) {
+		syslog(LOG_WARNING, "Discarding incompatible upgrade state");
+		return;
+	}
+
+	final_score = state.final_score;
+	response_final_score = state.response_final_score;
+	daemon_check_first_all_devices = state.daemon_check_first_all_devices;
+	rounds_total = state.rounds_total;
+	round_duration = state.round_duration;
+	memcpy(device_stats, state.device_stats, sizeof(device_stats));
+	syslog(LOG_INFO, "Resumed after upgrade with score %d", response_final_score);
+}
+
+/* Replace the running binary with the one on disk, keeping pid and results */
+static void upgrade_daemon(void)
+{
+	char fdstr[16];
+	int fd;
+
+	upgrade_requested = FALSE;
+
+	fd = save_state();
+	if (fd < 0) {
+		return;
+	}
+	snprintf(fdstr, sizeof(fdstr), "%d", fd);
+	setenv(SMON_UPGRADE_ENV, fdstr, 1);
+
+	syslog(LOG_INFO, "Re-executing %s", saved_argv[0]);
+
+	/* The new binary has to be able to bind the same IPC name. */
+	/* Idle probe threads need no care, exec() ends them.        */
+	qb_ipcs_destroy(ipcs);
+	execvp(saved_argv[0], saved_argv);
+
+	syslog(LOG_ERR, "Failed to execute %s: %s", saved_argv[0], strerror(errno));
+	unsetenv(SMON_UPGRADE_ENV);
+	close(fd);
+	if (storage_mon_ipcs_start() < 0) {
+		qb_loop_stop(storage_mon_poll_handle);
+	}
+}
+
+static int32_t sighup_handler(int num, void *data)
+{
+	if (shutting_down) {
+		return 0;
+	}
+
+	upgrade_requested = TRUE;
+	if (is_child_runnning()) {
+		syslog(LOG_INFO, "Upgrade requested, waiting for running device tests");
+	} else {
+		upgrade_daemon();
+	}
+	return 0;
+}
+
+static int32_t
+storage_mon_daemon(int interval, const char *pidfile)
+{
+	if (!upgrade_resumed) {
+		if (daemon(0, 0) < 0) {
+			syslog(LOG_ERR, "Failed to daemonize: %s", strerror(errno));
+			return -1;
+		}
+
+		umask(S_IWGRP | S_IWOTH | S_IROTH);
+
+		if (write_pid_file(pidfile) < 0) {
+			return -1;
+		}
+	}
+
+	storage_mon_poll_handle = qb_loop_create();
+
+	if (storage_mon_ipcs_start() < 0) {
+		return -1;
+	}
 
 	qb_loop_signal_add(storage_mon_poll_handle, QB_LOOP_HIGH,
 		SIGTERM, NULL, sigterm_handler, NULL);
@@ -759,10 +1279,20 @@ storage_mon_daemon(int interval, const char *pidfile)
 	qb_loop_signal_add(storage_mon_poll_handle, QB_LOOP_MED,
 		SIGCHLD, NULL, sigchld_handler, NULL);
 
+	qb_loop_signal_add(storage_mon_poll_handle, QB_LOOP_MED,
+		SIGHUP, NULL, sighup_handler, NULL);
+
+	if (probe_threads && start_probe_threads() < 0) {
+		return -1;
+	}
+
 	timer_d.interval = interval;
 	qb_loop_timer_add(storage_mon_poll_handle, QB_LOOP_MED, 0, &timer_d, wrap_test_device_main, &timer_handle); 
 
 	qb_loop_run(storage_mon_poll_handle);
+	if (probe_threads) {
+		stop_probe_threads();
+	}
 	qb_loop_destroy(storage_mon_poll_handle);
 
 	unlink(pidfile);
@@ -787,11 +1317,15 @@ int main(int argc, char *argv[])
 		{"interval", required_argument, 0, 'i' },
 		{"pidfile", required_argument, 0, 'p' },
 		{"attrname", required_argument, 0, 'a' },
+		{"metrics-file", required_argument, 0, 0 },
+		{"probe-mode", required_argument, 0, 0 },
 		{"verbose", no_argument, 0, 'v' },
 		{"help",    no_argument, 0,       'h' },
 		{0,         0,           0,        0  }
 	};
 
+	saved_argv = argv;
+
 	while ( (opt = getopt_long(argc, argv, "hvt:d:s:i:p:a:",
 				   long_options, &option_index)) != -1 ) {
 		switch (opt) {
@@ -809,6 +1343,23 @@ int main(int argc, char *argv[])
 				if (strcmp(long_options[option_index].name, "client") == 0) {
 					client = TRUE;
 				}
+				if (strcmp(long_options[option_index].name, "probe-mode") == 0) {
+					if (strcmp(optarg, "thread") == 0) {
+						probe_threads = TRUE;
+					} else if (strcmp(optarg, "fork") == 0) {
+						probe_threads = FALSE;
+					} else {
+						fprintf(stderr, "invalid probe mode %s, must be fork or thread\n", optarg);
+						return -1;
+					}
+				}
+				if (strcmp(long_options[option_index].name, "metrics-file") == 0) {
+					metrics_file = strdup(optarg);
+					if (metrics_file == NULL) {
+						fprintf(stderr, "Failed to duplicate string ['%s']\n", optarg);
+						return -1;
+					}
+				}
 				if (daemonize && client) {
 					fprintf(stderr,"The daemonize option and client option cannot be specified at the same time.");	
 					return -1;
@@ -892,8 +1443,17 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	if (probe_threads && !daemonize) {
+		fprintf(stderr, "The thread probe mode is only supported with the daemonize option\n");
+		return -1;
+	}
+
 	openlog("storage_mon", 0, LOG_DAEMON);
 
+	if (daemonize) {
+		restore_state();
+	}
+
 	if (!daemonize) {
 		final_score = test_device_main(NULL);
 	} else {
@@ -0,0 +1,270 @@
+#!/bin/bash
+
+# Multi-node contention test for sfex on file-backed devices.
+#
+# Several sfex_daemon instances with distinct node names compete for one
+# lock while holders are crashed (SIGKILL) or stalled (SIGSTOP/SIGCONT).
+# The lock block is polled throughout, and a holder that writes the lock
+# again after another node took it over is reported as a double-holder
+# violation.
+#
+# Needs sfex_init, sfex_stat and an sfex_daemon built with SFEX_TESTING,
+# which exits instead of rebooting the node when it loses its lock:
+#   make -C tools check    (builds sfex_daemon_testing)
+#
+# Settings can be overridden from the environment, timings are in ms:
+#   NODES=3 ROUNDS=10 DEVICES=1 (or 3/5 for a replicated lock area)
+#   COLLISION_TIMEOUT=50 MONITOR_INTERVAL=100 LOCK_TIMEOUT=400
+
+export LC_ALL=C
+set -u
+COLOR=0
+if [ -t 1 ] && echo -e foo | grep -Eqv "^-e"; then
+	COLOR=1
+else
+	COLOR=0
+fi
+ok () {
+	[ $COLOR -eq 1 ] \
+	    && echo -en "[\033[32m OK \033[0m]" \
+	    || echo -n "[ OK ]"
+	echo " $*"
+}
+fail () {
+	[ $COLOR -eq 1 ] \
+	    && echo -en "[\033[31mFAIL\033[0m]" \
+	    || echo -n "[FAIL]"
+	echo " $*"
+	FAILED=$((FAILED + 1))
+}
+info () {
+	[ $COLOR -eq 1 ] \
+	    && echo -e "\033[34m$@\033[0m" \
+	    || echo "$*"
+}
+die() { echo "$*"; exit 255; }
+
+HERE="$(dirname "$0")"
+SFEX_INIT=${SFEX_INIT:-${HERE}/sfex_init}
+SFEX_STAT=${SFEX_STAT:-${HERE}/sfex_stat}
+SFEX_DAEMON=${SFEX_DAEMON:-${HERE}/sfex_daemon_testing}
+NODES=${NODES:-3}
+ROUNDS=${ROUNDS:-10}
+DEVICES=${DEVICES:-1}
+COLLISION_TIMEOUT=${COLLISION_TIMEOUT:-50}
+MONITOR_INTERVAL=${MONITOR_INTERVAL:-100}
+LOCK_TIMEOUT=${LOCK_TIMEOUT:-400}
+SLACK=${SLACK:-250}
+FAILED=0
+
+[ -x "$SFEX_INIT" ] || die "$SFEX_INIT not found, set SFEX_INIT"
+[ -x "$SFEX_STAT" ] || die "$SFEX_STAT not found, set SFEX_STAT"
+[ -x "$SFEX_DAEMON" ] || die "$SFEX_DAEMON not found, set SFEX_DAEMON"
+[ "$NODES" -ge 2 ] || die "NODES must be 2 or more"
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/sfex-contention.XXXXXX") || die "mktemp failed"
+DEVS=""
+for d in $(seq $DEVICES); do
+	DEVS="$DEVS $WORK/dev$d"
+done
+POLLER=""
+cleanup () {
+	[ -n "$POLLER" ] && kill $POLLER 2>/dev/null
+	for pid in $(daemon_pids); do
+		kill -CONT $pid 2>/dev/null
+		kill -KILL $pid 2>/dev/null
+	done
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+now_ms () { echo $(($(date +%s%N) / 1000000)); }
+
+# every instance gets a node name of its own, so a write by a stale
+# holder can be told from a new acquisition by the same node
+SEQ=0
+daemon_pids () {
+	pgrep -f "$SFEX_DAEMON .* sfexcont-" 2>/dev/null
+}
+node_pid () { pgrep -f "$SFEX_DAEMON .* sfexcont-$1 "; }
+# a fenced daemon may stay a zombie until its new parent reaps it
+alive () {
+	st=$(ps -o stat= -p $1 2>/dev/null)
+	[ -n "$st" ] && [ "${st#Z}" = "$st" ]
+}
+
+# start_node <name>: runs sfex_daemon in the foreground until the lock is
+# acquired or given up, and writes "<rc> <elapsed ms>" to $WORK/<name>.rc
+start_node () {
+	t0=$(now_ms)
+	"$SFEX_DAEMON" -i 1 -c ${COLLISION_TIMEOUT}ms -t ${LOCK_TIMEOUT}ms \
+	    -m ${MONITOR_INTERVAL}ms -n "$1" -r "sfexcont-$1" $DEVS 2>>$WORK/daemon.log
+	echo "$? $(($(now_ms) - t0))" > $WORK/$1.rc
+}
+
+reset_area () {
+	for dev in $DEVS; do
+		dd if=/dev/zero of=$dev bs=512 count=2 2>/dev/null || die "cannot create $dev"
+	done
+	"$SFEX_INIT" -n 1 $DEVS >/dev/null || die "sfex_init failed"
+}
+
+# log every change of the lock as seen by a majority read
+start_poller () {
+	"$SFEX_STAT" -w 5 $DEVS > $WORK/poll.log 2>/dev/null &
+	POLLER=$!
+}
+
+stop_poller () {
+	kill $POLLER 2>/dev/null
+	wait $POLLER 2>/dev/null
+	POLLER=""
+}
+
+# a locked name that shows up again after another locked name means a
+# holder kept writing after it lost the lock
+count_violations () {
+	awk '$3 == "lock" && $5 == "lock" {
+		if ($6 != cur) {
+			if ($6 in seen) v++
+			seen[cur] = 1; cur = $6
+		}
+	} END { print v + 0 }' $WORK/poll.log
+}
+
+stop_all () {
+	for pid in $(daemon_pids); do
+		kill -CONT $pid 2>/dev/null
+		kill -TERM $pid 2>/dev/null
+	done
+	for pid in $(daemon_pids); do
+		while alive $pid; do sleep 0.05; done
+	done
+}
+
+# latency statistics of the numbers on stdin
+stats () {
+	sort -n | awk '{ a[NR] = $1; s += $1 }
+		END { if (NR) printf "min %dms avg %dms max %dms (n=%d)", a[1], s / NR, a[NR], NR
+		      else printf "no samples" }'
+}
+
+info "nodes=$NODES rounds=$ROUNDS devices=$DEVICES collision_timeout=${COLLISION_TIMEOUT}ms lock_timeout=${LOCK_TIMEOUT}ms monitor_interval=${MONITOR_INTERVAL}ms"
+: > $WORK/daemon.log
+
+# 1. all nodes start at once on a free lock: at most one may win, the
+# others back off after collision_timeout
+collisions=0 refusals=0 nowinner=0 multi=0 violations=0
+: > $WORK/lat
+for r in $(seq $ROUNDS); do
+	reset_area
+	start_poller
+	names=""
+	for n in $(seq $NODES); do
+		SEQ=$((SEQ + 1)); names="$names n$n.$SEQ"
+	done
+	for name in $names; do start_node $name & done
+	wait $(jobs -p | grep -v "^$POLLER\$") 2>/dev/null
+	winners=0
+	for name in $names; do
+		read rc ms < $WORK/$name.rc
+		if [ $rc -eq 0 ]; then
+			winners=$((winners + 1)); echo $ms >> $WORK/lat
+		elif [ $rc -eq 2 ] && [ $ms -lt $LOCK_TIMEOUT ]; then
+			collisions=$((collisions + 1))
+		elif [ $rc -eq 2 ]; then
+			# started after the winner wrote, waited lock_timeout
+			refusals=$((refusals + 1))
+		fi
+	done
+	sleep $(awk "BEGIN { print $MONITOR_INTERVAL * 2 / 1000 }")
+	stop_poller
+	violations=$((violations + $(count_violations)))
+	[ $winners -eq 0 ] && nowinner=$((nowinner + 1))
+	[ $winners -gt 1 ] && multi=$((multi + 1))
+	stop_all
+done
+info "free lock contention: acquisition $(stats < $WORK/lat), collisions detected $collisions, refused as held $refusals, rounds without a winner $nowinner"
+if [ $multi -eq 0 ] && [ $violations -eq 0 ]; then
+	ok "free lock contention: never more than one holder"
+else
+	fail "free lock contention: $multi rounds with several winners, $violations double-holder writes"
+fi
+
+# 2. the holder crashes and the other nodes race for the takeover
+multi=0 violations=0 nowinner=0 lost=0
+: > $WORK/lat
+for r in $(seq $ROUNDS); do
+	reset_area
+	SEQ=$((SEQ + 1)); holder=h.$SEQ
+	start_node $holder
+	start_poller
+	kill -KILL $(node_pid $holder)
+	t0=$(now_ms)
+	names=""
+	for n in $(seq 2 $NODES); do
+		SEQ=$((SEQ + 1)); names="$names n$n.$SEQ"
+	done
+	for name in $names; do start_node $name & done
+	wait $(jobs -p | grep -v "^$POLLER\$") 2>/dev/null
+	winners=0
+	for name in $names; do
+		read rc ms < $WORK/$name.rc
+		[ $rc -eq 0 ] && winners=$((winners + 1))
+		# a collision, or another taker's write seen while waiting
+		[ $rc -eq 2 ] && lost=$((lost + 1))
+	done
+	[ $winners -gt 0 ] && echo $(($(now_ms) - t0)) >> $WORK/lat
+	sleep $(awk "BEGIN { print $MONITOR_INTERVAL * 2 / 1000 }")
+	stop_poller
+	violations=$((violations + $(count_violations)))
+	[ $winners -eq 0 ] && nowinner=$((nowinner + 1))
+	[ $winners -gt 1 ] && multi=$((multi + 1))
+	stop_all
+done
+info "takeover after a crash: takeover $(stats < $WORK/lat), backed off $lost, rounds without a winner $nowinner"
+if [ $multi -eq 0 ] && [ $violations -eq 0 ]; then
+	ok "takeover after a crash: never more than one holder"
+else
+	fail "takeover after a crash: $multi rounds with several winners, $violations double-holder writes"
+fi
+
+# 3. the holder stalls for longer than lock_timeout while another node
+# takes over; once resumed it must fence without writing the lock
+violations=0 late=0 notaken=0
+: > $WORK/lat
+for r in $(seq $ROUNDS); do
+	reset_area
+	SEQ=$((SEQ + 1)); holder=h.$SEQ
+	start_node $holder
+	hpid=$(node_pid $holder)
+	start_poller
+	kill -STOP $hpid
+	SEQ=$((SEQ + 1)); taker=n2.$SEQ
+	start_node $taker
+	read rc ms < $WORK/$taker.rc
+	[ $rc -ne 0 ] && notaken=$((notaken + 1))
+	t0=$(now_ms)
+	kill -CONT $hpid
+	while alive $hpid; do
+		[ $(($(now_ms) - t0)) -gt $((MONITOR_INTERVAL + SLACK)) ] && break
+		sleep 0.01
+	done
+	if alive $hpid; then
+		late=$((late + 1))
+	else
+		echo $(($(now_ms) - t0)) >> $WORK/lat
+	fi
+	sleep $(awk "BEGIN { print $MONITOR_INTERVAL * 2 / 1000 }")
+	stop_poller
+	violations=$((violations + $(count_violations)))
+	stop_all
+done
+info "stalled holder: fenced $(stats < $WORK/lat) after resuming, takeovers refused $notaken"
+if [ $violations -eq 0 ] && [ $late -eq 0 ]; then
+	ok "stalled holder: fenced without writing the lock again"
+else
+	fail "stalled holder: $violations double-holder writes, $late holders still running"
+fi
+
+exit $FAILED
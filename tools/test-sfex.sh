@@ -0,0 +1,119 @@
+#!/bin/sh
+
+# Lock takeover timing test for sfex on a file-backed device.
+#
+# Needs sfex_init and an sfex_daemon built with SFEX_TESTING, which exits
+# instead of rebooting the node when it loses its lock:
+#   make -C tools check    (builds sfex_daemon_testing)
+#
+# Timings are in milliseconds and can be overridden from the environment,
+# e.g. LOCK_TIMEOUT=1000 ./test-sfex.sh; META_VERSION=2 selects the
+# version 2 meta-data format.
+#
+# SFEX_DEV=/dev/sdX runs the test on a scratch disk instead, whose first
+# blocks are overwritten. A disk that supports COMPARE AND WRITE, e.g. a
+# LIO fileio backstore exported through the tcm_loop fabric, exercises
+# the atomic lock updates:
+#   targetcli /backstores/fileio create sfex /var/tmp/sfex.img 1M
+#   targetcli /loopback create
+#   targetcli /loopback/naa.<wwn>/luns create /backstores/fileio/sfex
+
+export LC_ALL=C
+test -n "$BASH_VERSION" && set -o posix
+set -u
+COLOR=0
+if [ -t 1 ] && echo -e foo | grep -Eqv "^-e"; then
+	COLOR=1
+else
+	COLOR=0
+fi
+ok () {
+	[ $COLOR -eq 1 ] \
+	    && echo -en "[\033[32m OK \033[0m]" \
+	    || echo -n "[ OK ]"
+	echo " $*"
+}
+fail () {
+	[ $COLOR -eq 1 ] \
+	    && echo -en "[\033[31mFAIL\033[0m]" \
+	    || echo -n "[FAIL]"
+	echo " $*"
+	FAILED=$((FAILED + 1))
+}
+info () {
+	[ $COLOR -eq 1 ] \
+	    && echo -e "\033[34m$@\033[0m" \
+	    || echo "$*"
+}
+die() { echo "$*"; exit 255; }
+
+HERE="$(dirname "$0")"
+SFEX_INIT=${SFEX_INIT:-${HERE}/sfex_init}
+SFEX_DAEMON=${SFEX_DAEMON:-${HERE}/sfex_daemon_testing}
+COLLISION_TIMEOUT=${COLLISION_TIMEOUT:-50}
+MONITOR_INTERVAL=${MONITOR_INTERVAL:-100}
+LOCK_TIMEOUT=${LOCK_TIMEOUT:-400}
+META_VERSION=${META_VERSION:-1}
+SLACK=${SLACK:-250}
+FAILED=0
+
+[ -x "$SFEX_INIT" ] || die "$SFEX_INIT not found, set SFEX_INIT"
+[ -x "$SFEX_DAEMON" ] || die "$SFEX_DAEMON not found, set SFEX_DAEMON"
+
+if [ -n "${SFEX_DEV:-}" ]; then
+	DEV=$SFEX_DEV
+else
+	DEV=$(mktemp "${TMPDIR:-/tmp}/sfex-test.XXXXXX") || die "mktemp failed"
+fi
+cleanup () {
+	pkill -KILL -f "$SFEX_DAEMON .* sfextest-" 2>/dev/null
+	[ -z "${SFEX_DEV:-}" ] && rm -f "$DEV"
+}
+trap cleanup EXIT
+
+now_ms () { echo $(($(date +%s%N) / 1000000)); }
+
+# start_node <node>: returns the sfex_daemon exit code once the lock has
+# been acquired (the daemon then goes to the background) or given up
+start_node () {
+	"$SFEX_DAEMON" -i 1 -c ${COLLISION_TIMEOUT}ms -t ${LOCK_TIMEOUT}ms \
+	    -m ${MONITOR_INTERVAL}ms -n "$1" -r "sfextest-$1" "$DEV" 2>/dev/null
+}
+node_pid () { pgrep -f "$SFEX_DAEMON .* sfextest-$1 "; }
+
+# timed <min> <max> <expected rc> <description> <node>
+timed () {
+	t0=$(now_ms)
+	start_node "$5"
+	rc=$?
+	elapsed=$(($(now_ms) - t0))
+	if [ $rc -ne "$3" ]; then
+		fail "$4: exit code $rc, expected $3"
+	elif [ $elapsed -lt "$1" ] || [ $elapsed -gt "$2" ]; then
+		fail "$4: ${elapsed}ms, expected $1..$2ms"
+	else
+		ok "$4: ${elapsed}ms"
+	fi
+}
+
+dd if=/dev/zero of="$DEV" bs=512 count=2 conv=notrunc 2>/dev/null || die "cannot create $DEV"
+"$SFEX_INIT" -n 1 -v $META_VERSION "$DEV" || die "sfex_init failed"
+
+info "version=${META_VERSION} collision_timeout=${COLLISION_TIMEOUT}ms lock_timeout=${LOCK_TIMEOUT}ms monitor_interval=${MONITOR_INTERVAL}ms"
+
+timed $COLLISION_TIMEOUT $((COLLISION_TIMEOUT + SLACK)) 0 \
+    "acquire a free lock" nodeA
+
+timed $LOCK_TIMEOUT $((LOCK_TIMEOUT + SLACK)) 2 \
+    "lock held by a live node is refused" nodeB
+
+kill -KILL $(node_pid nodeA)
+timed $((LOCK_TIMEOUT + COLLISION_TIMEOUT)) $((LOCK_TIMEOUT + COLLISION_TIMEOUT + SLACK)) 0 \
+    "takeover after the holder crashed" nodeB
+
+kill -TERM $(node_pid nodeB)
+while node_pid nodeB >/dev/null; do sleep 0.05; done
+timed $COLLISION_TIMEOUT $((COLLISION_TIMEOUT + SLACK)) 0 \
+    "acquire after a clean release" nodeA
+
+exit $FAILED
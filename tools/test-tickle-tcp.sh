@@ -0,0 +1,128 @@
+#!/bin/sh
+
+# Send test and benchmark for tickle_tcp over a veth pair.
+#
+# Two network namespaces, tt-a and tt-b, are connected by a veth pair,
+# va in tt-a and vb in tt-b. tickle_tcp runs in tt-a and tickles CONNS
+# made up connections to a peer on vb, half of them IPv4 and half IPv6,
+# once through the raw sockets and once through the TX ring on va (-i).
+# The peer's MAC address is a permanent neighbor entry, so that nothing
+# waits for address resolution. Every packet must arrive on vb.
+#
+# For verification (-V), the peer is then given its addresses. It has no
+# sockets, so it answers every tickle with a RST, which must be seen for
+# all connections.
+#
+# Needs root and the ip utility. Settings can be overridden from the
+# environment:
+#   TICKLE_TCP=./tickle_tcp CONNS=200000 RUNS=3
+
+export LC_ALL=C
+test -n "$BASH_VERSION" && set -o posix
+set -u
+COLOR=0
+if [ -t 1 ] && echo -e foo | grep -Eqv "^-e"; then
+	COLOR=1
+else
+	COLOR=0
+fi
+ok () {
+	[ $COLOR -eq 1 ] \
+	    && echo -en "[\033[32m OK \033[0m]" \
+	    || echo -n "[ OK ]"
+	echo " $*"
+}
+fail () {
+	[ $COLOR -eq 1 ] \
+	    && echo -en "[\033[31mFAIL\033[0m]" \
+	    || echo -n "[FAIL]"
+	echo " $*"
+	FAILED=$((FAILED + 1))
+}
+info () {
+	[ $COLOR -eq 1 ] \
+	    && echo -e "\033[34m$@\033[0m" \
+	    || echo "$*"
+}
+die() { echo "$*"; exit 255; }
+
+HERE="$(dirname "$0")"
+TICKLE_TCP=${TICKLE_TCP:-${HERE}/tickle_tcp}
+CONNS=${CONNS:-200000}
+RUNS=${RUNS:-3}
+FAILED=0
+
+[ -x "$TICKLE_TCP" ] || die "$TICKLE_TCP not found, set TICKLE_TCP"
+[ "$(id -u)" -eq 0 ] || die "must be run as root"
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/tickle-tcp.XXXXXX") || die "mktemp failed"
+cleanup () {
+	ip netns del tt-a 2>/dev/null
+	ip netns del tt-b 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+ip netns add tt-a && ip netns add tt-b || die "cannot create network namespaces"
+ip -n tt-a link add va type veth peer name vb netns tt-b || die "cannot create veth pair"
+ip -n tt-a addr add 10.3.0.1/16 dev va
+ip -n tt-a addr add fd03::1/64 dev va nodad
+ip -n tt-b link set vb address 02:00:00:00:03:02
+ip -n tt-a link set va up
+ip -n tt-b link set vb up
+ip -n tt-a neigh add 10.3.0.2 lladdr 02:00:00:00:03:02 dev va nud permanent
+ip -n tt-a neigh add fd03::2 lladdr 02:00:00:00:03:02 dev va nud permanent
+
+awk -v n=$CONNS 'BEGIN {
+	for (i = 0; i < n / 2; i++) {
+		printf "10.3.0.1:%d\t10.3.0.2:%d\n", 1024 + i % 60000, 2049 + int(i / 60000)
+		printf "[fd03::1]:%d\t[fd03::2]:%d\n", 1024 + i % 60000, 2049 + int(i / 60000)
+	}
+}' > $WORK/conns
+
+rx_packets () {
+	ip netns exec tt-b cat /sys/class/net/vb/statistics/rx_packets
+}
+
+# run <description> <tickle_tcp options>...
+run () {
+	desc=$1; shift
+	for r in $(seq $RUNS); do
+		before=$(rx_packets)
+		ip netns exec tt-a "$TICKLE_TCP" -v "$@" < $WORK/conns 2> $WORK/log
+		rc=$?
+		sent=$(($(rx_packets) - before))
+		rate=$(sed -n 's/.*(\([0-9]*\) packets\/s).*/\1/p' $WORK/log | tail -1)
+		if [ $rc -ne 0 ] || [ $sent -lt $CONNS ]; then
+			fail "$desc: exit code $rc, $sent of $CONNS packets arrived"
+			cat $WORK/log
+		else
+			ok "$desc: $sent packets, $rate packets/s"
+		fi
+	done
+}
+
+# verify <description> <tickle_tcp options>...
+verify () {
+	desc=$1; shift
+	ip netns exec tt-a "$TICKLE_TCP" -V "$@" < $WORK/conns > $WORK/summary 2> $WORK/log
+	rc=$?
+	if [ $rc -ne 0 ] ||
+	    ! grep -q "^$CONNS of $CONNS connections answered" $WORK/summary; then
+		fail "$desc: exit code $rc"
+		cat $WORK/summary $WORK/log
+	else
+		ok "$desc: $(grep ^latency $WORK/summary)"
+	fi
+}
+
+info "connections=$CONNS runs=$RUNS"
+run "raw sockets"
+run "TX ring"  -i va
+
+ip -n tt-b addr add 10.3.0.2/16 dev vb
+ip -n tt-b addr add fd03::2/64 dev vb nodad
+verify "verification, raw sockets"
+verify "verification, TX ring" -i va
+
+exit $FAILED
@@ -20,18 +20,33 @@
 */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <arpa/inet.h>
 #include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
 
 #define discard_const(ptr) ((void *)((intptr_t)(ptr)))
 
@@ -46,34 +61,42 @@ void set_close_on_exec(int fd);
 static int parse_ipv4(const char *s, unsigned port, struct sockaddr_in *sin);
 static int parse_ipv6(const char *s, const char *iface, unsigned port, sock_addr *saddr);
 int parse_ip(const char *addr, const char *iface, unsigned port, sock_addr *saddr);
+int parse_ip_port_n(const char *addr, size_t len, sock_addr *saddr);
 int parse_ip_port(const char *addr, sock_addr *saddr);
 int send_tickle_ack(const sock_addr *dst, 
 		    const sock_addr *src, 
 		    uint32_t seq, uint32_t ack, int rst);
+int flush_tickle_acks(void);
+void close_tickle_sockets(void);
+static void run_benchmark(long count);
 static void usage(void);
 
-static uint32_t uint16_checksum(uint16_t *data, size_t n)
+/*
+  The data is read byte by byte: the callers hand in addresses and
+  headers of other types, and reading those through a uint16_t pointer
+  let the compiler drop the stores to the IPv6 pseudo-header.
+*/
+static uint32_t uint16_checksum(const void *data, size_t n)
 {
+	const uint8_t *p = data;
 	uint32_t sum=0;
 	while (n >= 2) {
-		sum += (uint32_t)ntohs(*data);
-		data++;        
+		sum += (uint32_t)((p[0] << 8) | p[1]);
+		p += 2;
 		n -= 2;
-	}                      
+	}
 	if (n == 1) {
-		sum += (uint32_t)ntohs(*(uint8_t *)data);
+		sum += (uint32_t)(p[0] << 8);
 	}
 	return sum;
-}       
+}
 
-static uint16_t tcp_checksum(uint16_t *data, size_t n, struct iphdr *ip)
+static uint16_t tcp_checksum(const void *data, size_t n, const struct iphdr *ip)
 {
 	uint32_t sum = uint16_checksum(data, n);
 	uint16_t sum2;
-	sum += uint16_checksum((uint16_t *)(void *)&ip->saddr,
-				sizeof(ip->saddr));
-	sum += uint16_checksum((uint16_t *)(void *)&ip->daddr,
-				sizeof(ip->daddr));
+	sum += uint16_checksum(&ip->saddr, sizeof(ip->saddr));
+	sum += uint16_checksum(&ip->daddr, sizeof(ip->daddr));
 	sum += ip->protocol + n;
 	sum = (sum & 0xFFFF) + (sum >> 16);
 	sum = (sum & 0xFFFF) + (sum >> 16);
@@ -85,7 +108,7 @@ static uint16_t tcp_checksum(uint16_t *data, size_t n, struct iphdr *ip)
 	return sum2;
 }
 
-static uint16_t tcp_checksum6(uint16_t *data, size_t n, struct ip6_hdr *ip6)
+static uint16_t tcp_checksum6(const void *data, size_t n, const struct ip6_hdr *ip6)
 {
 	uint32_t phdr[2];
 	uint32_t sum = 0;
@@ -93,12 +116,12 @@ static uint16_t tcp_checksum6(uint16_t *data, size_t n, struct ip6_hdr *ip6)
 
 	memset(phdr, 0, sizeof(phdr));
 
-	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_src, 16);
-	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_dst, 16);
+	sum += uint16_checksum(&ip6->ip6_src, 16);
+	sum += uint16_checksum(&ip6->ip6_dst, 16);
 
 	phdr[0] = htonl(n);
 	phdr[1] = htonl(ip6->ip6_nxt);
-	sum += uint16_checksum((uint16_t *)phdr, 8);
+	sum += uint16_checksum(phdr, 8);
 
 	sum += uint16_checksum(data, n);
 
@@ -112,6 +135,61 @@ static uint16_t tcp_checksum6(uint16_t *data, size_t n, struct ip6_hdr *ip6)
 	return sum2;
 }
 
+/*
+  One's complement sum of 32-bit words in a 64-bit accumulator, which
+  does not overflow for any packet we build. The sum is kept in network
+  byte order, so the folded result goes into the header as it is.
+*/
+static uint64_t wide_checksum(const void *data, size_t n, uint64_t sum)
+{
+	const uint8_t *p = data;
+	uint32_t w;
+
+	for (; n >= 16; n -= 16, p += 16) {
+		uint32_t w4[4];
+		memcpy(w4, p, 16);
+		sum += (uint64_t)w4[0] + w4[1] + w4[2] + w4[3];
+	}
+	for (; n >= 4; n -= 4, p += 4) {
+		memcpy(&w, p, 4);
+		sum += w;
+	}
+	if (n) {
+		w = 0;
+		memcpy(&w, p, n);
+		sum += w;
+	}
+	return sum;
+}
+
+static uint16_t fold_checksum(uint64_t sum)
+{
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return ~sum;
+}
+
+/*
+  RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'), for one 16-bit word m of the
+  checksummed data that changes to m'. All values in network byte order.
+*/
+static uint16_t csum_replace16(uint16_t check, uint16_t old, uint16_t new)
+{
+	uint32_t sum = (uint16_t)~check + (uint16_t)~old + new;
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return ~sum;
+}
+
+static uint16_t csum_replace32(uint16_t check, uint32_t old, uint32_t new)
+{
+	check = csum_replace16(check, old & 0xFFFF, new & 0xFFFF);
+	return csum_replace16(check, old >> 16, new >> 16);
+}
+
 void set_nonblocking(int fd)
 {
 	unsigned v;
@@ -172,209 +250,2438 @@ int parse_ip(const char *addr, const char *iface, unsigned port, sock_addr *sadd
 	return ret;
 }
 
-int parse_ip_port(const char *addr, sock_addr *saddr)
+/*
+  Interface names of scoped addresses, the last one looked up is kept:
+  a state file names the same few interfaces over and over.
+*/
+static unsigned scope_index(const char *name, size_t len)
 {
-	char *s, *p;
-	unsigned port;
-	char *endp = NULL;
-	int ret;
+	static char last[IF_NAMESIZE];
+	static unsigned last_index;
+	char buf[IF_NAMESIZE];
+	unsigned long n;
+	char *endp;
 
-	s = strdup(addr);
-	if (!s) {
-		fprintf(stderr, "Failed strdup()\n");
-		return -1;
+	if (len == 0 || len >= IF_NAMESIZE)
+		return 0;
+	memcpy(buf, name, len);
+	buf[len] = 0;
+
+	n = strtoul(buf, &endp, 10);
+	if (*endp == 0)
+		return n;
+	if (last_index && !strcmp(buf, last))
+		return last_index;
+	last_index = if_nametoindex(buf);
+	memcpy(last, buf, len + 1);
+	return last_index;
+}
+
+/*
+  Parse "ip:port" of len characters, not NUL terminated, without
+  allocating. IPv6 addresses come as "[addr]:port" or, as older state
+  files have them, "addr:port"; either may carry a "%scope", an
+  interface name or index.
+*/
+int parse_ip_port_n(const char *addr, size_t len, sock_addr *saddr)
+{
+	char buf[INET6_ADDRSTRLEN];
+	const char *end = addr + len, *ip = addr, *ip_end, *port, *scope;
+	unsigned long n = 0;
+
+	if (len && *addr == '[') {
+		ip = addr + 1;
+		ip_end = memchr(ip, ']', end - ip);
+		if (!ip_end || ip_end + 1 >= end || ip_end[1] != ':')
+			return -1;
+		port = ip_end + 2;
+	} else {
+		for (ip_end = end; ip_end > addr && ip_end[-1] != ':'; ip_end--)
+			;
+		if (ip_end == addr)
+			return -1;
+		port = ip_end--;
 	}
 
-	p = rindex(s, ':');
-	if (!p) {
-		fprintf(stderr, "This addr: %s does not contain a port number\n", s);
-		free(s);
+	if (port == end || end - port > 5)
 		return -1;
+	for (; port < end; port++) {
+		if (*port < '0' || *port > '9')
+			return -1;
+		n = n * 10 + *port - '0';
 	}
-	
-	port = strtoul(p+1, &endp, 10);
-	if (!endp || *endp != 0) {
-		fprintf(stderr, "Trailing garbage after the port in %s\n", s);
-		free(s);
+	if (n > 65535)
 		return -1;
+
+	scope = memchr(ip, '%', ip_end - ip);
+	if ((scope ? scope : ip_end) - ip >= (ptrdiff_t)sizeof(buf))
+		return -1;
+	memcpy(buf, ip, (scope ? scope : ip_end) - ip);
+	buf[(scope ? scope : ip_end) - ip] = 0;
+
+	memset(saddr, 0, sizeof(*saddr));
+	if (!memchr(buf, ':', strlen(buf))) {
+		if (scope || inet_pton(AF_INET, buf, &saddr->ip.sin_addr) != 1)
+			return -1;
+		saddr->ip.sin_family = AF_INET;
+		saddr->ip.sin_port = htons(n);
+		return 0;
 	}
-	*p = 0;
 
-	ret = parse_ip(s, NULL, port, saddr);
-	free(s);
-	return ret;
+	if (inet_pton(AF_INET6, buf, &saddr->ip6.sin6_addr) != 1)
+		return -1;
+	saddr->ip6.sin6_family = AF_INET6;
+	saddr->ip6.sin6_port = htons(n);
+	if (scope) {
+		saddr->ip6.sin6_scope_id = scope_index(scope + 1, ip_end - scope - 1);
+		if (saddr->ip6.sin6_scope_id == 0)
+			return -1;
+	}
+	return 0;
 }
 
-int send_tickle_ack(const sock_addr *dst, 
-		    const sock_addr *src, 
-		    uint32_t seq, uint32_t ack, int rst)
+int parse_ip_port(const char *addr, sock_addr *saddr)
 {
-	int s;
-	int ret;
-	uint32_t one = 1;
-	uint16_t tmpport;
-	sock_addr *tmpdest;
+	if (parse_ip_port_n(addr, strlen(addr), saddr)) {
+		fprintf(stderr, "Failed to translate %s into an address and port\n", addr);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  Packets are not sent one by one: queue_tickle() queues them, and a
+  full queue, or one for the other address family, is handed to the
+  kernel with a single sendmmsg() on a raw socket that stays open for
+  the whole run.
+*/
+#define TICKLE_BATCH 64
+
+typedef union {
 	struct {
 		struct iphdr ip;
 		struct tcphdr tcp;
-	} ip4pkt;
+	} ip4;
 	struct {
 		struct ip6_hdr ip6;
 		struct tcphdr tcp;
-	} ip6pkt;
-
-	switch (src->ip.sin_family) {
-	case AF_INET:
-		memset(&ip4pkt, 0, sizeof(ip4pkt));
-		ip4pkt.ip.version  = 4;
-		ip4pkt.ip.ihl      = sizeof(ip4pkt.ip)/4;
-		ip4pkt.ip.tot_len  = htons(sizeof(ip4pkt));
-		ip4pkt.ip.ttl      = 255;
-		ip4pkt.ip.protocol = IPPROTO_TCP;
-		ip4pkt.ip.saddr    = src->ip.sin_addr.s_addr;
-		ip4pkt.ip.daddr    = dst->ip.sin_addr.s_addr;
-		ip4pkt.ip.check    = 0;
-
-		ip4pkt.tcp.source  = src->ip.sin_port;
-		ip4pkt.tcp.dest    = dst->ip.sin_port;
-		ip4pkt.tcp.seq     = seq;
-		ip4pkt.tcp.ack_seq = ack;
-		ip4pkt.tcp.ack     = 1;
-		if (rst)
-			ip4pkt.tcp.rst = 1;
-		ip4pkt.tcp.doff    = sizeof(ip4pkt.tcp)/4;
-		ip4pkt.tcp.window   = htons(1234);
-		ip4pkt.tcp.check    = tcp_checksum((uint16_t *)&ip4pkt.tcp, sizeof(ip4pkt.tcp), &ip4pkt.ip);
-
-		s = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
-		if (s == -1) {
-			fprintf(stderr, "Failed to open raw socket (%s)\n", strerror(errno));
-			return -1;
+	} ip6;
+} tickle_pkt;
+
+static struct {
+	int fd4, fd6;
+	int family;		/* of the queued packets */
+	unsigned int count;
+	tickle_pkt pkt[TICKLE_BATCH];
+	sock_addr dst[TICKLE_BATCH];
+	struct iovec iov[TICKLE_BATCH];
+	struct mmsghdr msg[TICKLE_BATCH];
+	unsigned long sent, dropped;
+	int last_errno;
+} queue = { .fd4 = -1, .fd6 = -1 };
+
+/*
+  A prebuilt packet for one connection, see build_tickle_template().
+*/
+typedef struct {
+	int family;
+	int hop;		/* in ring.hops with -i, -1 sends with sendmmsg() */
+	size_t len;
+	sock_addr dst;		/* as handed to sendmmsg() */
+	tickle_pkt pkt;
+} tickle_template;
+
+static int open_raw_socket(int family)
+{
+	int s;
+	uint32_t one = 1;
+
+	s = socket(family, SOCK_RAW, IPPROTO_RAW);
+	if (s == -1) {
+		fprintf(stderr, "Failed to open raw socket (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	/* implied for IPv6 raw sockets with IPPROTO_RAW */
+	if (family == AF_INET &&
+	    setsockopt(s, SOL_IP, IP_HDRINCL, &one, sizeof(one)) != 0) {
+		fprintf(stderr, "Failed to setup IP headers (%s)\n", strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	set_nonblocking(s);
+	set_close_on_exec(s);
+	return s;
+}
+
+/*
+  With -i, packets for peers reached through that Ethernet interface
+  are written as frames into a PACKET_TX_RING shared with the kernel
+  instead, and the kernel is kicked with one send() per TICKLE_BATCH
+  frames, without a system call or a sendmsg() copy per packet. Each
+  frame goes to the MAC address of the next hop, the gateway or the
+  peer itself, as resolve_hops() found it in the neighbor table. Frames
+  are reclaimed in order from ring.tail once the kernel has sent them.
+*/
+#define RING_FRAME_SIZE 128	/* tpacket2_hdr, Ethernet and tickle_pkt */
+#define RING_FRAMES 8192
+#define RING_STALL_MS 1000	/* give up on a ring that sends nothing */
+
+struct neighbor {
+	int family;
+	uint8_t addr[16];
+	uint8_t mac[ETH_ALEN];
+};
+
+static struct {
+	int fd;
+	int ifindex;
+	uint8_t mac[ETH_ALEN];
+	uint8_t *map;
+	size_t map_len;
+	unsigned int head, tail;	/* next frame to fill, oldest in flight */
+	unsigned int inflight, unkicked;
+	struct neighbor *hops;
+	unsigned long nhops;
+} ring = { .fd = -1 };
+
+static int open_tx_ring(const char *ifname)
+{
+	struct tpacket_req req;
+	struct sockaddr_ll sll;
+	struct ifreq ifr;
+	int s, version = TPACKET_V2, one = 1, sndbuf = RING_FRAMES * 1024;
+
+	if (strlen(ifname) >= sizeof(ifr.ifr_name)) {
+		fprintf(stderr, "Bad interface '%s'\n", ifname);
+		return -1;
+	}
+	/* protocol 0: nothing is received on this socket */
+	s = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (s == -1) {
+		fprintf(stderr, "Failed to open packet socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, ifname);
+	if (ioctl(s, SIOCGIFINDEX, &ifr) == -1) {
+		fprintf(stderr, "No interface '%s' (%s)\n", ifname, strerror(errno));
+		goto fail;
+	}
+	ring.ifindex = ifr.ifr_ifindex;
+	if (ioctl(s, SIOCGIFHWADDR, &ifr) == -1 ||
+	    ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+		fprintf(stderr, "'%s' is not an Ethernet interface\n", ifname);
+		goto fail;
+	}
+	memcpy(ring.mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	/* a block per page, the frames packed back to back */
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = sysconf(_SC_PAGESIZE);
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = RING_FRAMES;
+	req.tp_block_nr = RING_FRAMES / (req.tp_block_size / RING_FRAME_SIZE);
+	if (setsockopt(s, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) ||
+	    setsockopt(s, SOL_PACKET, PACKET_LOSS, &one, sizeof(one)) ||
+	    setsockopt(s, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req))) {
+		fprintf(stderr, "Failed to set up the TX ring (%s)\n", strerror(errno));
+		goto fail;
+	}
+	/* room for the whole ring in flight, as far as we may */
+	if (setsockopt(s, SOL_SOCKET, SO_SNDBUFFORCE, &sndbuf, sizeof(sndbuf)))
+		setsockopt(s, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	ring.map_len = (size_t)req.tp_block_size * req.tp_block_nr;
+	ring.map = mmap(NULL, ring.map_len, PROT_READ | PROT_WRITE, MAP_SHARED, s, 0);
+	if (ring.map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map the TX ring (%s)\n", strerror(errno));
+		goto fail;
+	}
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_ifindex = ring.ifindex;
+	if (bind(s, (struct sockaddr *)&sll, sizeof(sll))) {
+		fprintf(stderr, "Failed to bind to '%s' (%s)\n", ifname, strerror(errno));
+		munmap(ring.map, ring.map_len);
+		goto fail;
+	}
+	ring.fd = s;
+	return 0;
+fail:
+	close(s);
+	return -1;
+}
+
+static struct tpacket2_hdr *ring_frame(unsigned int i)
+{
+	return (struct tpacket2_hdr *)(ring.map + (size_t)i * RING_FRAME_SIZE);
+}
+
+/*
+  Hand the filled frames to the kernel. A full socket buffer or device
+  queue leaves frames waiting in the ring, a later kick sends them.
+*/
+static int kick_tx_ring(void)
+{
+	ring.unkicked = 0;
+	while (send(ring.fd, NULL, 0, MSG_DONTWAIT) == -1) {
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == ENOBUFS)
+			return 0;
+		if (errno != queue.last_errno)
+			fprintf(stderr, "Failed to send from the TX ring (%s)\n", strerror(errno));
+		queue.last_errno = errno;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  Reclaim the frames the kernel is done with. One it refused as
+  malformed comes back as TP_STATUS_WRONG_FORMAT, due to PACKET_LOSS,
+  and is counted as dropped.
+*/
+static void reap_tx_ring(void)
+{
+	while (ring.inflight) {
+		struct tpacket2_hdr *hdr = ring_frame(ring.tail);
+		uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+
+		if (status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+			break;
+		if (status & TP_STATUS_WRONG_FORMAT) {
+			queue.sent--;
+			queue.dropped++;
+			__atomic_store_n(&hdr->tp_status, TP_STATUS_AVAILABLE, __ATOMIC_RELEASE);
 		}
+		ring.tail = (ring.tail + 1) % RING_FRAMES;
+		ring.inflight--;
+	}
+}
+
+/*
+  Wait until at most max frames are in flight. Fails if the kernel
+  stops taking frames for RING_STALL_MS, e.g. from a device that lost
+  its carrier, or refuses to send.
+*/
+static int wait_tx_ring(unsigned int max)
+{
+	struct timespec stall, now;
+	unsigned int inflight = ring.inflight;
 
-		ret = setsockopt(s, SOL_IP, IP_HDRINCL, &one, sizeof(one));
-		if (ret != 0) {
-			fprintf(stderr, "Failed to setup IP headers (%s)\n", strerror(errno));
-			close(s);
+	clock_gettime(CLOCK_MONOTONIC, &stall);
+	reap_tx_ring();
+	while (ring.inflight > max) {
+		struct pollfd pfd = { .fd = ring.fd, .events = POLLOUT };
+
+		if (kick_tx_ring())
+			return -1;
+		poll(&pfd, 1, 1);
+		reap_tx_ring();
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (ring.inflight < inflight) {
+			inflight = ring.inflight;
+			stall = now;
+		} else if ((now.tv_sec - stall.tv_sec) * 1000 +
+			   (now.tv_nsec - stall.tv_nsec) / 1000000 >= RING_STALL_MS) {
+			fprintf(stderr, "The TX ring stalled with %u frames in flight\n",
+				ring.inflight);
 			return -1;
 		}
+	}
+	return 0;
+}
+
+/*
+  Close the ring once the frames in flight are sent. Those that cannot
+  be are counted as dropped.
+*/
+static void close_tx_ring(void)
+{
+	if (ring.fd == -1)
+		return;
+	wait_tx_ring(0);
+	queue.sent -= ring.inflight;
+	queue.dropped += ring.inflight;
+	ring.inflight = 0;
+	munmap(ring.map, ring.map_len);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+/*
+  Send the queued packets. A full socket buffer is waited for. A packet
+  the kernel refuses otherwise, e.g. with ENOBUFS when the device queue
+  overflows, is counted as dropped and the rest are still sent, so that
+  one bad peer does not cost all the others their tickle. Returns the
+  number of packets dropped.
+*/
+int flush_tickle_acks(void)
+{
+	unsigned int done = 0;
+	int s, dropped = 0;
 
-		set_nonblocking(s);
-		set_close_on_exec(s);
+	if (ring.fd != -1 && ring.unkicked && kick_tx_ring())
+		close_tx_ring();
+	if (queue.count == 0)
+		return 0;
 
-		ret = sendto(s, &ip4pkt, sizeof(ip4pkt), 0, 
-			     (const struct sockaddr *)&dst->ip, sizeof(dst->ip));
-		close(s);
-		if (ret != sizeof(ip4pkt)) {
-			fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
-			return -1;
+	s = queue.family == AF_INET ? queue.fd4 : queue.fd6;
+	while (done < queue.count) {
+		int ret = sendmmsg(s, &queue.msg[done], queue.count - done, 0);
+		if (ret == -1) {
+			struct pollfd pfd = { .fd = s, .events = POLLOUT };
+
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				poll(&pfd, 1, 100);
+				continue;
+			}
+			/* the first message failed, report each reason once */
+			if (errno != queue.last_errno)
+				fprintf(stderr, "Failed sendmmsg (%s)\n", strerror(errno));
+			queue.last_errno = errno;
+			dropped++;
+			done++;
+			continue;
 		}
-		break;
+		queue.sent += ret;
+		done += ret;
+	}
+	queue.dropped += dropped;
+	queue.count = 0;
+	return dropped;
+}
+
+void close_tickle_sockets(void)
+{
+	close_tx_ring();
+	if (queue.fd4 != -1)
+		close(queue.fd4);
+	if (queue.fd6 != -1)
+		close(queue.fd6);
+	queue.fd4 = queue.fd6 = -1;
+}
 
-        case AF_INET6:
-		memset(&ip6pkt, 0, sizeof(ip6pkt));
-		ip6pkt.ip6.ip6_vfc  = 0x60;
-		ip6pkt.ip6.ip6_plen = htons(20);
-		ip6pkt.ip6.ip6_nxt  = IPPROTO_TCP;
-		ip6pkt.ip6.ip6_hlim = 64;
-		ip6pkt.ip6.ip6_src  = src->ip6.sin6_addr;
-		ip6pkt.ip6.ip6_dst  = dst->ip6.sin6_addr;
-
-		ip6pkt.tcp.source   = src->ip6.sin6_port;
-		ip6pkt.tcp.dest     = dst->ip6.sin6_port;
-		ip6pkt.tcp.seq      = seq;
-		ip6pkt.tcp.ack_seq  = ack;
-		ip6pkt.tcp.ack      = 1;
+/*
+  Fill in the headers of a tickle ACK, leaving the TCP checksum 0.
+  Returns the packet length.
+*/
+static size_t fill_tickle_pkt(tickle_pkt *pkt, const sock_addr *dst,
+			      const sock_addr *src,
+			      uint32_t seq, uint32_t ack, int rst)
+{
+	memset(pkt, 0, sizeof(*pkt));
+
+	if (src->ip.sin_family == AF_INET) {
+		pkt->ip4.ip.version  = 4;
+		pkt->ip4.ip.ihl      = sizeof(pkt->ip4.ip)/4;
+		pkt->ip4.ip.tot_len  = htons(sizeof(pkt->ip4));
+		pkt->ip4.ip.ttl      = 255;
+		pkt->ip4.ip.protocol = IPPROTO_TCP;
+		pkt->ip4.ip.saddr    = src->ip.sin_addr.s_addr;
+		pkt->ip4.ip.daddr    = dst->ip.sin_addr.s_addr;
+		pkt->ip4.ip.check    = 0;
+
+		pkt->ip4.tcp.source  = src->ip.sin_port;
+		pkt->ip4.tcp.dest    = dst->ip.sin_port;
+		pkt->ip4.tcp.seq     = seq;
+		pkt->ip4.tcp.ack_seq = ack;
+		pkt->ip4.tcp.ack     = 1;
 		if (rst)
-			ip6pkt.tcp.rst      = 1;
-		ip6pkt.tcp.doff     = sizeof(ip6pkt.tcp)/4;
-		ip6pkt.tcp.window   = htons(1234);
-		ip6pkt.tcp.check    = tcp_checksum6((uint16_t *)&ip6pkt.tcp, sizeof(ip6pkt.tcp), &ip6pkt.ip6);
-
-		s = socket(PF_INET6, SOCK_RAW, IPPROTO_RAW);
-		if (s == -1) {
-			fprintf(stderr, "Failed to open sending socket\n");
-			return -1;
-                }
+			pkt->ip4.tcp.rst = 1;
+		pkt->ip4.tcp.doff    = sizeof(pkt->ip4.tcp)/4;
+		pkt->ip4.tcp.window  = htons(1234);
+		return sizeof(pkt->ip4);
+	}
 
-		tmpdest = discard_const(dst);
-		tmpport = tmpdest->ip6.sin6_port;
+	pkt->ip6.ip6.ip6_vfc  = 0x60;
+	pkt->ip6.ip6.ip6_plen = htons(20);
+	pkt->ip6.ip6.ip6_nxt  = IPPROTO_TCP;
+	pkt->ip6.ip6.ip6_hlim = 64;
+	pkt->ip6.ip6.ip6_src  = src->ip6.sin6_addr;
+	pkt->ip6.ip6.ip6_dst  = dst->ip6.sin6_addr;
 
-		tmpdest->ip6.sin6_port = 0;
-		ret = sendto(s, &ip6pkt, sizeof(ip6pkt), 0, (const struct sockaddr *)&dst->ip6, sizeof(dst->ip6));
-		tmpdest->ip6.sin6_port = tmpport;
-		close(s);
+	pkt->ip6.tcp.source   = src->ip6.sin6_port;
+	pkt->ip6.tcp.dest     = dst->ip6.sin6_port;
+	pkt->ip6.tcp.seq      = seq;
+	pkt->ip6.tcp.ack_seq  = ack;
+	pkt->ip6.tcp.ack      = 1;
+	if (rst)
+		pkt->ip6.tcp.rst      = 1;
+	pkt->ip6.tcp.doff     = sizeof(pkt->ip6.tcp)/4;
+	pkt->ip6.tcp.window   = htons(1234);
+	return sizeof(pkt->ip6);
+}
 
-		if (ret != sizeof(ip6pkt)) {
-			fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
-			return -1;
-		}
-		break;
+static struct tcphdr *tickle_tcphdr(tickle_pkt *pkt, int family)
+{
+	return family == AF_INET ? &pkt->ip4.tcp : &pkt->ip6.tcp;
+}
 
-	default:
+/*
+  TCP checksum of a filled in packet, over the pseudo-header and the
+  TCP header, with wide_checksum().
+*/
+static uint16_t tickle_checksum(const tickle_pkt *pkt, int family)
+{
+	uint64_t sum;
+
+	if (family == AF_INET) {
+		sum = wide_checksum(&pkt->ip4.ip.saddr, 8, 0);
+		sum += htonl(IPPROTO_TCP + sizeof(pkt->ip4.tcp));
+		sum = wide_checksum(&pkt->ip4.tcp, sizeof(pkt->ip4.tcp), sum);
+	} else {
+		sum = wide_checksum(&pkt->ip6.ip6.ip6_src, 32, 0);
+		sum += htonl(sizeof(pkt->ip6.tcp));
+		sum += htonl(IPPROTO_TCP);
+		sum = wide_checksum(&pkt->ip6.tcp, sizeof(pkt->ip6.tcp), sum);
+	}
+	return fold_checksum(sum);
+}
+
+/*
+  Build the packet for one connection, with seq and ack 0 and without
+  RST, once. queue_tickle() then only patches those fields.
+*/
+static int build_tickle_template(tickle_template *t, const sock_addr *dst,
+				  const sock_addr *src)
+{
+	t->family = src->ip.sin_family;
+	if ((t->family != AF_INET && t->family != AF_INET6) ||
+	    dst->ip.sin_family != t->family) {
 		fprintf(stderr, "Not an ipv4/v6 address\n");
 		return -1;
 	}
 
+	t->hop = -1;
+	t->len = fill_tickle_pkt(&t->pkt, dst, src, 0, 0, 0);
+	tickle_tcphdr(&t->pkt, t->family)->check =
+		tickle_checksum(&t->pkt, t->family);
+	/* filled in by the kernel on a raw socket, not in a TX ring frame */
+	if (t->family == AF_INET)
+		t->pkt.ip4.ip.check = fold_checksum(wide_checksum(&t->pkt.ip4.ip,
+							sizeof(t->pkt.ip4.ip), 0));
+
+	if (t->family == AF_INET) {
+		t->dst.ip = dst->ip;
+	} else {
+		/* a raw IPv6 socket wants no port in the destination */
+		t->dst.ip6 = dst->ip6;
+		t->dst.ip6.sin6_port = 0;
+	}
 	return 0;
 }
 
-static void usage(void)
+/*
+  Copy a template into pkt and set seq, ack and RST, updating the
+  checksum incrementally.
+*/
+static void patch_tickle_pkt(tickle_pkt *pkt, const tickle_template *t,
+			     uint32_t seq, uint32_t ack, int rst)
 {
-	printf("Usage: /usr/lib/heartbeat/tickle_tcp [ -n num ]\n");
-	printf("Please note that this program need to read the list of\n");
-	printf("{local_ip:port remote_ip:port} from stdin.\n");
-	exit(1);
+	struct tcphdr *tcp;
+	uint16_t check, flags_old, flags_new;
+
+	memcpy(pkt, &t->pkt, t->len);
+	tcp = tickle_tcphdr(pkt, t->family);
+	check = tcp->check;
+
+	if (seq) {
+		check = csum_replace32(check, 0, seq);
+		tcp->seq = seq;
+	}
+	if (ack) {
+		check = csum_replace32(check, 0, ack);
+		tcp->ack_seq = ack;
+	}
+	if (rst) {
+		/* the word with data offset and flags follows ack_seq */
+		memcpy(&flags_old, (uint8_t *)tcp + 12, 2);
+		tcp->rst = 1;
+		memcpy(&flags_new, (uint8_t *)tcp + 12, 2);
+		check = csum_replace16(check, flags_old, flags_new);
+	}
+	tcp->check = check;
 }
 
-#define OPTION_STRING "n:h"
+/*
+  Put a tickle into the next frame of the TX ring, waiting for a free
+  one when the ring is full. If the ring fails it is closed, and this
+  and all later tickles go through the raw sockets.
+*/
+static int ring_tickle(const tickle_template *t, uint32_t seq, uint32_t ack, int rst)
+{
+	struct tpacket2_hdr *hdr;
+	struct ethhdr *eth;
+	tickle_pkt pkt;
 
-int main(int argc, char *argv[])
+	if (ring.inflight == RING_FRAMES && wait_tx_ring(RING_FRAMES - 1)) {
+		close_tx_ring();
+		return -1;
+	}
+	hdr = ring_frame(ring.head);
+	/* where the kernel expects the frame without PACKET_TX_HAS_OFF */
+	eth = (struct ethhdr *)((uint8_t *)hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll));
+	memcpy(eth->h_dest, ring.hops[t->hop].mac, ETH_ALEN);
+	memcpy(eth->h_source, ring.mac, ETH_ALEN);
+	eth->h_proto = htons(t->family == AF_INET ? ETH_P_IP : ETH_P_IPV6);
+	/* the IP header would not be aligned in the frame */
+	patch_tickle_pkt(&pkt, t, seq, ack, rst);
+	memcpy(eth + 1, &pkt, t->len);
+	hdr->tp_len = ETH_HLEN + t->len;
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+	ring.head = (ring.head + 1) % RING_FRAMES;
+	ring.inflight++;
+	queue.sent++;
+	/* the frame is accounted for by close_tx_ring() if this fails */
+	if (++ring.unkicked == TICKLE_BATCH && kick_tx_ring())
+		close_tx_ring();
+	return 0;
+}
+
+static int queue_tickle(const tickle_template *t, uint32_t seq, uint32_t ack, int rst)
 {
-	int optchar, i, num = 1, cont = 1;
-	sock_addr src, dst;
-	char addrline[128], addr1[64], addr2[64];
+	struct msghdr *hdr;
 
-	while(cont) {
-		optchar = getopt(argc, argv, OPTION_STRING);
-		switch(optchar) {
-		case 'n':
-			num = atoi(optarg);
-			break;
-		case 'h':
-			usage();
-			exit(EXIT_SUCCESS);
-			break;
-		case EOF:
-			cont = 0;
-			break;
-		default:
-			fprintf(stderr, "unknown option, please use '-h' for usage.\n");
+	if (t->hop >= 0 && ring.fd != -1 && ring_tickle(t, seq, ack, rst) == 0)
+		return 0;
+	if (queue.count == TICKLE_BATCH ||
+	    (queue.count && queue.family != t->family))
+		flush_tickle_acks();
+	if (t->family == AF_INET && queue.fd4 == -1 &&
+	    (queue.fd4 = open_raw_socket(AF_INET)) == -1)
+		return -1;
+	if (t->family == AF_INET6 && queue.fd6 == -1 &&
+	    (queue.fd6 = open_raw_socket(AF_INET6)) == -1)
+		return -1;
+
+	queue.family = t->family;
+	patch_tickle_pkt(&queue.pkt[queue.count], t, seq, ack, rst);
+	queue.dst[queue.count] = t->dst;
+
+	queue.iov[queue.count].iov_base = &queue.pkt[queue.count];
+	queue.iov[queue.count].iov_len  = t->len;
+	hdr = &queue.msg[queue.count].msg_hdr;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->msg_name    = &queue.dst[queue.count];
+	hdr->msg_namelen = t->family == AF_INET ?
+		sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+	hdr->msg_iov     = &queue.iov[queue.count];
+	hdr->msg_iovlen  = 1;
+	queue.count++;
+
+	return 0;
+}
+
+int send_tickle_ack(const sock_addr *dst, 
+		    const sock_addr *src, 
+		    uint32_t seq, uint32_t ack, int rst)
+{
+	tickle_template t;
+
+	if (build_tickle_template(&t, dst, src))
+		return -1;
+	return queue_tickle(&t, seq, ack, rst);
+}
+
+static double bench_ns(const struct timespec *start, long count)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec - start->tv_sec) * 1e9 +
+		(end.tv_nsec - start->tv_nsec)) / count;
+}
+
+/*
+  Time building count packets for one IPv4 and one IPv6 connection:
+  from scratch with the 16-bit sum used before templates, from scratch
+  with wide_checksum(), and from a template. Nothing is sent.
+*/
+static void run_benchmark(long count)
+{
+	static const char *pairs[][2] = {
+		{ "192.168.1.1:2049", "192.168.1.2:675" },
+		{ "fd00::1:2049", "fd00::2:675" },
+	};
+	volatile uint16_t sink = 0;
+	unsigned int p;
+
+	for (p = 0; p < sizeof(pairs) / sizeof(pairs[0]); p++) {
+		sock_addr src, dst;
+		tickle_template t;
+		tickle_pkt pkt;
+		struct timespec start;
+		struct tcphdr *tcp;
+		uint16_t legacy;
+		long i;
+
+		if (parse_ip_port(pairs[p][0], &src) ||
+		    parse_ip_port(pairs[p][1], &dst) ||
+		    build_tickle_template(&t, &dst, &src))
 			exit(EXIT_FAILURE);
-			break;
-		};
+		tcp = tickle_tcphdr(&pkt, t.family);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; i++) {
+			size_t len = fill_tickle_pkt(&pkt, &dst, &src, i, i, 0);
+			if (t.family == AF_INET)
+				tcp->check = tcp_checksum(tcp, len - sizeof(pkt.ip4.ip), &pkt.ip4.ip);
+			else
+				tcp->check = tcp_checksum6(tcp, len - sizeof(pkt.ip6.ip6), &pkt.ip6.ip6);
+			sink += tcp->check;
+		}
+		printf("%-6s full build, 16-bit sum:  %6.1f ns/packet\n",
+		       t.family == AF_INET ? "IPv4" : "IPv6", bench_ns(&start, count));
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; i++) {
+			fill_tickle_pkt(&pkt, &dst, &src, i, i, 0);
+			tcp->check = tickle_checksum(&pkt, t.family);
+			sink += tcp->check;
+		}
+		printf("%-6s full build, 64-bit sum:  %6.1f ns/packet\n",
+		       t.family == AF_INET ? "IPv4" : "IPv6", bench_ns(&start, count));
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; i++) {
+			patch_tickle_pkt(&pkt, &t, i, i, 0);
+			sink += tcp->check;
+		}
+		printf("%-6s template, incremental:   %6.1f ns/packet\n",
+		       t.family == AF_INET ? "IPv4" : "IPv6", bench_ns(&start, count));
+
+		/* all three must agree, 0 and 0xFFFF both being zero */
+		fill_tickle_pkt(&pkt, &dst, &src, htonl(0x12345678), htonl(0x9abcdef0), 1);
+		if (t.family == AF_INET)
+			legacy = tcp_checksum(tcp, sizeof(*tcp), &pkt.ip4.ip);
+		else
+			legacy = tcp_checksum6(tcp, sizeof(*tcp), &pkt.ip6.ip6);
+		sink = tickle_checksum(&pkt, t.family);
+		patch_tickle_pkt(&pkt, &t, htonl(0x12345678), htonl(0x9abcdef0), 1);
+		if ((legacy % 0xFFFF) != (sink % 0xFFFF) ||
+		    (sink % 0xFFFF) != (tcp->check % 0xFFFF)) {
+			fprintf(stderr, "checksum mismatch: %04x %04x %04x\n",
+				legacy, sink, tcp->check);
+			exit(EXIT_FAILURE);
+		}
 	}
+}
 
-	while(fgets(addrline, sizeof(addrline), stdin)) {
-		sscanf(addrline, "%s %s", addr1, addr2);
+/*
+  Connections can be found through NETLINK_SOCK_DIAG instead of being
+  read from stdin. All established TCP sockets are dumped and those
+  whose local address is the given one, and whose local port is in the
+  port list if there is one, are handed to the callback as
+  (local, remote). An IPv4 address is also looked for in its IPv4-mapped
+  form on IPv6 sockets.
+*/
+struct diag_sock {
+	int family;			/* of the socket, not of the address */
+	struct inet_diag_sockid id;	/* as dumped, with the cookie */
+};
 
-		if (parse_ip_port(addr1, &src)) {
-			fprintf(stderr, "Bad IP:port '%s'\n", addr1);
-			return -1;
+typedef int (*conn_fn)(const sock_addr *local, const sock_addr *remote,
+		       const struct diag_sock *ds, void *arg);
+
+static uint8_t port_set[65536 / 8];
+static int port_filter;
+
+/*
+  Parse a port list as portblock takes it: "137,138,1000:1010".
+*/
+static int parse_port_list(const char *list)
+{
+	const char *p = list;
+
+	while (*p) {
+		char *endp;
+		unsigned long lo, hi;
+
+		lo = strtoul(p, &endp, 10);
+		hi = lo;
+		if (endp != p && (*endp == ':' || *endp == '-')) {
+			p = endp + 1;
+			hi = strtoul(p, &endp, 10);
 		}
-		if (parse_ip_port(addr2, &dst)) {
-			fprintf(stderr, "Bad IP:port '%s'\n", addr2);
+		if (endp == p || (*endp && *endp != ',') ||
+		    lo > 65535 || hi > 65535 || lo > hi) {
+			fprintf(stderr, "Bad port list '%s'\n", list);
 			return -1;
 		}
-	
-		for (i = 1; i <= num; i++) {
-			if (send_tickle_ack(&dst, &src, 0, 0, 0)) {
-				fprintf(stderr, "Error while sending tickle ack from '%s' to '%s'\n",
-					addr1, addr2);
-				return -1;
-			}
-		}
+		for (; lo <= hi; lo++)
+			port_set[lo / 8] |= 1 << (lo % 8);
+		p = *endp ? endp + 1 : endp;
+	}
+	port_filter = 1;
+	return 0;
+}
+
+static int diag_match(const sock_addr *ip, int family,
+		      const struct inet_diag_sockid *id)
+{
+	static const uint8_t mapped[12] =
+		{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+	unsigned port = ntohs(id->idiag_sport);
 
+	if (port_filter && !(port_set[port / 8] & (1 << (port % 8))))
+		return 0;
+	if (ip->sa.sa_family == AF_INET6)
+		return family == AF_INET6 &&
+			!memcmp(id->idiag_src, &ip->ip6.sin6_addr, 16);
+	if (family == AF_INET)
+		return id->idiag_src[0] == ip->ip.sin_addr.s_addr;
+	return !memcmp(id->idiag_src, mapped, 12) &&
+		id->idiag_src[3] == ip->ip.sin_addr.s_addr;
+}
+
+/*
+  Turn one end of a diag socket id into a sock_addr of the family of
+  the address we look for, unmapping IPv4-mapped addresses.
+*/
+static void diag_addr(sock_addr *sa, int family, int sock_family,
+		      const __be32 *addr, __be16 port, uint32_t ifindex)
+{
+	memset(sa, 0, sizeof(*sa));
+	if (family == AF_INET) {
+		sa->ip.sin_family = AF_INET;
+		sa->ip.sin_port = port;
+		sa->ip.sin_addr.s_addr = addr[sock_family == AF_INET ? 0 : 3];
+	} else {
+		sa->ip6.sin6_family = AF_INET6;
+		sa->ip6.sin6_port = port;
+		memcpy(&sa->ip6.sin6_addr, addr, 16);
+		if (IN6_IS_ADDR_LINKLOCAL(&sa->ip6.sin6_addr))
+			sa->ip6.sin6_scope_id = ifindex;
 	}
+}
+
+static int diag_dump(int nl, int family, const sock_addr *ip,
+		     conn_fn fn, void *arg)
+{
+	static char buf[65536];
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 req;
+	} msg;
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+
+	memset(&msg, 0, sizeof(msg));
+	msg.nlh.nlmsg_len = sizeof(msg);
+	msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	msg.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	msg.req.sdiag_family = family;
+	msg.req.sdiag_protocol = IPPROTO_TCP;
+	msg.req.idiag_states = 1 << TCP_ESTABLISHED;
+
+	if (sendto(nl, &msg, sizeof(msg), 0,
+		   (struct sockaddr *)&nladdr, sizeof(nladdr)) != sizeof(msg)) {
+		fprintf(stderr, "Failed to send sock_diag request (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	while (1) {
+		struct nlmsghdr *h;
+		ssize_t len = recv(nl, buf, sizeof(buf), 0);
+
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed to read sock_diag reply (%s)\n", strerror(errno));
+			return -1;
+		}
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			struct inet_diag_msg *d = NLMSG_DATA(h);
+			struct diag_sock ds;
+			sock_addr local, remote;
+
+			if (h->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *e = NLMSG_DATA(h);
+				fprintf(stderr, "sock_diag dump failed (%s)\n", strerror(-e->error));
+				return -1;
+			}
+			if (!diag_match(ip, family, &d->id))
+				continue;
+			diag_addr(&local, ip->sa.sa_family, family,
+				  d->id.idiag_src, d->id.idiag_sport, d->id.idiag_if);
+			diag_addr(&remote, ip->sa.sa_family, family,
+				  d->id.idiag_dst, d->id.idiag_dport, d->id.idiag_if);
+			ds.family = family;
+			ds.id = d->id;
+			if (fn(&local, &remote, &ds, arg))
+				return -1;
+		}
+	}
+}
+
+static int discover_connections(const sock_addr *ip, conn_fn fn, void *arg)
+{
+	int nl, ret;
+
+	nl = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (nl == -1) {
+		fprintf(stderr, "Failed to open sock_diag socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	ret = diag_dump(nl, ip->sa.sa_family, ip, fn, arg);
+	if (ret == 0 && ip->sa.sa_family == AF_INET)
+		ret = diag_dump(nl, AF_INET6, ip, fn, arg);
+	close(nl);
+	return ret;
+}
+
+/*
+  Close a local socket found by discover_connections() through
+  SOCK_DESTROY. The kernel aborts it and sends the peer a RST with the
+  socket's own sequence numbers. Returns 0 when the socket is gone, 1
+  when the kernel cannot destroy sockets (no CONFIG_INET_DIAG_DESTROY)
+  and -1 on other errors.
+*/
+static int destroy_socket(int nl, const struct diag_sock *ds)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 req;
+	} msg;
+	struct {
+		struct nlmsghdr nlh;
+		struct nlmsgerr err;
+	} reply;
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+	ssize_t len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.nlh.nlmsg_len = sizeof(msg);
+	msg.nlh.nlmsg_type = SOCK_DESTROY;
+	msg.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	msg.req.sdiag_family = ds->family;
+	msg.req.sdiag_protocol = IPPROTO_TCP;
+	msg.req.idiag_states = ~0U;
+	msg.req.id = ds->id;
+
+	if (sendto(nl, &msg, sizeof(msg), 0,
+		   (struct sockaddr *)&nladdr, sizeof(nladdr)) != sizeof(msg)) {
+		fprintf(stderr, "Failed to send SOCK_DESTROY (%s)\n", strerror(errno));
+		return -1;
+	}
+	do {
+		len = recv(nl, &reply, sizeof(reply), 0);
+	} while (len == -1 && errno == EINTR);
+	if (len < (ssize_t)sizeof(reply) || reply.nlh.nlmsg_type != NLMSG_ERROR) {
+		fprintf(stderr, "Bad SOCK_DESTROY reply\n");
+		return -1;
+	}
+	switch (-reply.err.error) {
+	case 0:
+	case ENOENT:		/* closed meanwhile */
+		return 0;
+	case EOPNOTSUPP:
+		return 1;
+	default:
+		fprintf(stderr, "SOCK_DESTROY failed (%s)\n", strerror(-reply.err.error));
+		return -1;
+	}
+}
+
+/*
+  All connections are collected before the first packet goes out, be
+  they read from stdin or found through sock_diag. They are then
+  tickled in rounds, see send_rounds().
+*/
+#define MAX_ROUNDS 16
+
+/*
+  What -V keeps per connection: when it was last tickled, and how its
+  peer answered.
+*/
+struct verify_conn {
+	uint64_t sent_ns;	/* CLOCK_REALTIME, as the capture stamps */
+	uint32_t latency_us;	/* of the first response */
+	uint16_t responses;	/* saturates */
+	uint8_t round;		/* last tickled in, from 1 */
+	uint8_t rst;		/* the first response was a RST */
+};
+
+struct tickle_run {
+	int num;		/* tickle ACKs per connection and round */
+	int swap;		/* tickle the local end instead */
+	FILE *state;		/* connections are written here, -w */
+	int binary;		/* in the binary format, -F */
+	tickle_template *conns;
+	unsigned long nconns, alloc;
+	unsigned long rate;	/* packets/s, 0 is as fast as possible */
+	unsigned long burst;	/* packets sent back to back when paced */
+	unsigned int rounds;
+	long offset_ms[MAX_ROUNDS];	/* round start after the first */
+	int verbose;
+	int destroy_nl;		/* SOCK_DESTROY local sockets, -d */
+	int destroy_failed;	/* the kernel cannot, tickle instead */
+	unsigned long destroyed;
+	int reset;		/* answer replies with a RST, -k */
+	int verify;		/* count the replies, -V */
+	int replies;		/* replies are collected, for -k or -V */
+	int cap4, cap6;		/* receive the replies, see collect_replies() */
+	int capture;		/* or this AF_PACKET socket, with -V */
+	uint8_t *done;		/* connection replied */
+	struct verify_conn *vc;
+	uint32_t *slots;	/* hash of the connections, index + 1 */
+	unsigned long mask;
+	unsigned long replied, resets;
+};
+
+/*
+  Text form of an address as the state file has it, IPv6 in brackets.
+*/
+static void format_ip_port(char *buf, size_t len, const sock_addr *sa)
+{
+	char ip[INET6_ADDRSTRLEN], scope[IF_NAMESIZE + 1] = "";
+
+	if (sa->sa.sa_family == AF_INET) {
+		inet_ntop(AF_INET, &sa->ip.sin_addr, ip, sizeof(ip));
+		snprintf(buf, len, "%s:%u", ip, ntohs(sa->ip.sin_port));
+		return;
+	}
+	inet_ntop(AF_INET6, &sa->ip6.sin6_addr, ip, sizeof(ip));
+	if (sa->ip6.sin6_scope_id) {
+		scope[0] = '%';
+		if (!if_indextoname(sa->ip6.sin6_scope_id, scope + 1))
+			snprintf(scope + 1, sizeof(scope) - 1, "%u", sa->ip6.sin6_scope_id);
+	}
+	snprintf(buf, len, "[%s%s]:%u", ip, scope, ntohs(sa->ip6.sin6_port));
+}
+
+/*
+  Binary state file, for very large connection tables: the magic
+  STATE_MAGIC, then one record per connection. A record is a family
+  byte, 4 or 6, then the local address and port and the remote address
+  and port in network byte order. IPv6 records end with the scope id,
+  in network byte order as well.
+*/
+#define STATE_MAGIC "TCK\1"
+#define RECORD4_LEN (1 + 2 * (4 + 2))
+#define RECORD6_LEN (1 + 2 * (16 + 2) + 4)
+
+static int write_record(FILE *f, const sock_addr *local, const sock_addr *remote)
+{
+	uint8_t rec[RECORD6_LEN], *p = rec + 1;
+	uint32_t scope;
+
+	if (local->sa.sa_family == AF_INET) {
+		rec[0] = 4;
+		memcpy(p, &local->ip.sin_addr, 4);
+		memcpy(p + 4, &local->ip.sin_port, 2);
+		memcpy(p + 6, &remote->ip.sin_addr, 4);
+		memcpy(p + 10, &remote->ip.sin_port, 2);
+		return fwrite(rec, RECORD4_LEN, 1, f) == 1 ? 0 : -1;
+	}
+	rec[0] = 6;
+	memcpy(p, &local->ip6.sin6_addr, 16);
+	memcpy(p + 16, &local->ip6.sin6_port, 2);
+	memcpy(p + 18, &remote->ip6.sin6_addr, 16);
+	memcpy(p + 34, &remote->ip6.sin6_port, 2);
+	scope = htonl(local->ip6.sin6_scope_id);
+	memcpy(p + 36, &scope, 4);
+	return fwrite(rec, RECORD6_LEN, 1, f) == 1 ? 0 : -1;
+}
+
+static int parse_record(const uint8_t *rec, sock_addr *local, sock_addr *remote)
+{
+	const uint8_t *p = rec + 1;
+	uint32_t scope;
+
+	memset(local, 0, sizeof(*local));
+	memset(remote, 0, sizeof(*remote));
+	if (rec[0] == 4) {
+		local->ip.sin_family = remote->ip.sin_family = AF_INET;
+		memcpy(&local->ip.sin_addr, p, 4);
+		memcpy(&local->ip.sin_port, p + 4, 2);
+		memcpy(&remote->ip.sin_addr, p + 6, 4);
+		memcpy(&remote->ip.sin_port, p + 10, 2);
+		return 0;
+	}
+	local->ip6.sin6_family = remote->ip6.sin6_family = AF_INET6;
+	memcpy(&local->ip6.sin6_addr, p, 16);
+	memcpy(&local->ip6.sin6_port, p + 16, 2);
+	memcpy(&remote->ip6.sin6_addr, p + 18, 16);
+	memcpy(&remote->ip6.sin6_port, p + 34, 2);
+	memcpy(&scope, p + 36, 4);
+	local->ip6.sin6_scope_id = remote->ip6.sin6_scope_id = ntohl(scope);
+	return 0;
+}
+
+static int add_connection(const sock_addr *local, const sock_addr *remote,
+			  const struct diag_sock *ds, void *arg)
+{
+	struct tickle_run *run = arg;
+	tickle_template *t;
+
+	if (run->state && run->binary) {
+		write_record(run->state, local, remote);
+	} else if (run->state) {
+		char l[INET6_ADDRSTRLEN + IF_NAMESIZE + 9], r[INET6_ADDRSTRLEN + IF_NAMESIZE + 9];
+
+		format_ip_port(l, sizeof(l), local);
+		format_ip_port(r, sizeof(r), remote);
+		fprintf(run->state, "%s\t%s\n", l, r);
+	}
+	if (run->destroy_nl != -1 && ds && !run->destroy_failed) {
+		int ret = destroy_socket(run->destroy_nl, ds);
+
+		if (ret == 0) {
+			run->destroyed++;
+			return 0;
+		}
+		if (ret == 1) {
+			fprintf(stderr, "The kernel cannot destroy sockets, tickling them instead\n");
+			run->destroy_failed = 1;
+		}
+	}
+	if (run->num <= 0) {
+		run->nconns++;
+		return 0;
+	}
+
+	if (run->nconns == run->alloc) {
+		unsigned long alloc = run->alloc ? run->alloc * 2 : 1024;
+
+		t = realloc(run->conns, alloc * sizeof(*t));
+		if (!t) {
+			fprintf(stderr, "Failed realloc() for %lu connections\n", alloc);
+			return -1;
+		}
+		run->conns = t;
+		run->alloc = alloc;
+	}
+	t = &run->conns[run->nconns];
+	if (run->swap ? build_tickle_template(t, local, remote)
+		      : build_tickle_template(t, remote, local))
+		return -1;
+	run->nconns++;
+	return 0;
+}
+
+/*
+  Parse a repeat schedule: the start of each round in ms after the
+  first, e.g. "0,100,1000".
+*/
+static int parse_schedule(struct tickle_run *run, const char *list)
+{
+	const char *p = list;
+
+	run->rounds = 0;
+	while (*p) {
+		char *endp;
+		long ms = strtol(p, &endp, 10);
+
+		if (endp == p || (*endp && *endp != ',') || ms < 0 ||
+		    (run->rounds && ms < run->offset_ms[run->rounds - 1]) ||
+		    run->rounds == MAX_ROUNDS) {
+			fprintf(stderr, "Bad schedule '%s', at most %d increasing times in ms\n",
+				list, MAX_ROUNDS);
+			return -1;
+		}
+		run->offset_ms[run->rounds++] = ms;
+		p = *endp ? endp + 1 : endp;
+	}
+	return run->rounds ? 0 : -1;
+}
+
+static void ts_add_ns(struct timespec *ts, long long ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+static long long ts_diff_ns(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000000LL +
+		(to->tv_nsec - from->tv_nsec);
+}
+
+static void sleep_until(const struct timespec *ts)
+{
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, ts, NULL) == EINTR)
+		;
+}
+
+/*
+  The peer's end of a connection as the template addresses it, and our
+  own end. A reply comes from the former and goes to the latter.
+*/
+static const void *template_peer(const tickle_template *t, uint16_t *port)
+{
+	if (t->family == AF_INET) {
+		*port = t->pkt.ip4.tcp.dest;
+		return &t->pkt.ip4.ip.daddr;
+	}
+	*port = t->pkt.ip6.tcp.dest;
+	return &t->pkt.ip6.ip6.ip6_dst;
+}
+
+static const void *template_self(const tickle_template *t, uint16_t *port)
+{
+	if (t->family == AF_INET) {
+		*port = t->pkt.ip4.tcp.source;
+		return &t->pkt.ip4.ip.saddr;
+	}
+	*port = t->pkt.ip6.tcp.source;
+	return &t->pkt.ip6.ip6.ip6_src;
+}
+
+static uint32_t conn_hash(int family, const void *peer, uint16_t pport,
+			  uint16_t sport)
+{
+	const uint8_t *p = peer;
+	size_t i, n = family == AF_INET ? 4 : 16;
+	uint32_t h = 2166136261U;	/* FNV-1a */
+
+	for (i = 0; i < n; i++)
+		h = (h ^ p[i]) * 16777619U;
+	h = (h ^ (pport & 0xff)) * 16777619U;
+	h = (h ^ (pport >> 8)) * 16777619U;
+	h = (h ^ (sport & 0xff)) * 16777619U;
+	h = (h ^ (sport >> 8)) * 16777619U;
+	return h;
+}
+
+static int index_connections(struct tickle_run *run)
+{
+	unsigned long size = 1, c;
+
+	while (size < run->nconns * 2)
+		size <<= 1;
+	run->slots = calloc(size, sizeof(*run->slots));
+	run->done = calloc(run->nconns ? run->nconns : 1, 1);
+	if (!run->slots || !run->done) {
+		fprintf(stderr, "Failed calloc() for %lu connections\n", run->nconns);
+		return -1;
+	}
+	run->mask = size - 1;
+
+	for (c = 0; c < run->nconns; c++) {
+		const tickle_template *t = &run->conns[c];
+		uint16_t pport, sport;
+		const void *peer = template_peer(t, &pport);
+		uint32_t h;
+
+		template_self(t, &sport);
+		h = conn_hash(t->family, peer, pport, sport) & run->mask;
+		while (run->slots[h])
+			h = (h + 1) & run->mask;
+		run->slots[h] = c + 1;
+	}
+	return 0;
+}
+
+static long find_connection(const struct tickle_run *run, int family,
+			    const void *peer, uint16_t pport,
+			    const void *self, uint16_t sport)
+{
+	size_t n = family == AF_INET ? 4 : 16;
+	uint32_t h = conn_hash(family, peer, pport, sport) & run->mask;
+
+	for (; run->slots[h]; h = (h + 1) & run->mask) {
+		const tickle_template *t = &run->conns[run->slots[h] - 1];
+		uint16_t tp, ts;
+		const void *tpeer = template_peer(t, &tp);
+		const void *tself = template_self(t, &ts);
+
+		if (t->family == family && tp == pport && ts == sport &&
+		    !memcmp(tpeer, peer, n) && (!self || !memcmp(tself, self, n)))
+			return run->slots[h] - 1;
+	}
+	return -1;
+}
+
+/*
+  Next hops for -i, see ring_tickle(). The neighbor table of the
+  interface is dumped once, and the route to each peer is asked for
+  once, through rtnetlink. A peer whose next hop is not a known
+  neighbor on the interface, or that is not reached through it at all,
+  keeps hop -1. Addresses are hashed with conn_hash() and ports 0.
+*/
+#define NUD_USABLE (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE | NUD_PERMANENT)
+
+struct hop_slot {
+	int family;		/* 0 for a free slot */
+	uint8_t addr[16];
+	int hop;
+};
+
+struct hop_table {
+	struct hop_slot *slot;
+	unsigned long mask, used;
+};
+
+static struct hop_slot *hop_slot(const struct hop_table *tab, int family,
+				 const void *addr)
+{
+	size_t n = family == AF_INET ? 4 : 16;
+	uint32_t h = conn_hash(family, addr, 0, 0) & tab->mask;
+
+	for (; tab->slot[h].family; h = (h + 1) & tab->mask)
+		if (tab->slot[h].family == family && !memcmp(tab->slot[h].addr, addr, n))
+			break;
+	return &tab->slot[h];
+}
+
+static int hop_table_init(struct hop_table *tab, unsigned long size)
+{
+	tab->slot = calloc(size, sizeof(*tab->slot));
+	if (!tab->slot) {
+		fprintf(stderr, "Failed calloc() for %lu next hops\n", size);
+		return -1;
+	}
+	tab->mask = size - 1;
+	tab->used = 0;
+	return 0;
+}
+
+static int hop_insert(struct hop_table *tab, int family, const void *addr, int hop)
+{
+	struct hop_slot *sl;
+
+	if ((tab->used + 1) * 2 > tab->mask + 1) {
+		struct hop_table grown;
+		unsigned long i;
+
+		if (hop_table_init(&grown, (tab->mask + 1) * 2))
+			return -1;
+		for (i = 0; i <= tab->mask; i++)
+			if (tab->slot[i].family)
+				*hop_slot(&grown, tab->slot[i].family, tab->slot[i].addr) = tab->slot[i];
+		grown.used = tab->used;
+		free(tab->slot);
+		*tab = grown;
+	}
+	sl = hop_slot(tab, family, addr);
+	if (!sl->family) {
+		sl->family = family;
+		memcpy(sl->addr, addr, family == AF_INET ? 4 : 16);
+		tab->used++;
+	}
+	sl->hop = hop;
+	return 0;
+}
+
+typedef int (*rtnl_fn)(struct nlmsghdr *h, void *arg);
+
+/*
+  Send a request and hand the replies to fn, up to the end of a dump,
+  or the first reply otherwise. A netlink error sets errno.
+*/
+static int rtnl_talk(int nl, struct nlmsghdr *req, rtnl_fn fn, void *arg)
+{
+	static char buf[65536];
+	static uint32_t seq;
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+
+	req->nlmsg_seq = ++seq;
+	if (sendto(nl, req, req->nlmsg_len, 0, (struct sockaddr *)&nladdr,
+		   sizeof(nladdr)) != (ssize_t)req->nlmsg_len)
+		return -1;
+
+	while (1) {
+		struct nlmsghdr *h;
+		ssize_t len = recv(nl, buf, sizeof(buf), 0);
+
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_seq != seq)
+				continue;
+			if (h->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *e = NLMSG_DATA(h);
+				errno = -e->error;
+				return e->error ? -1 : 0;
+			}
+			if (fn(h, arg))
+				return -1;
+			if (!(req->nlmsg_flags & NLM_F_DUMP))
+				return 0;
+		}
+	}
+}
+
+static void add_rtattr(struct nlmsghdr *nlh, int type, const void *data, size_t len)
+{
+	struct rtattr *rta = (struct rtattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+static int add_neighbor(struct nlmsghdr *h, void *arg)
+{
+	struct ndmsg *nd = NLMSG_DATA(h);
+	struct rtattr *rta = (struct rtattr *)((char *)nd + NLMSG_ALIGN(sizeof(*nd)));
+	int len = NLMSG_PAYLOAD(h, sizeof(*nd));
+	struct neighbor *n;
+	void *dst = NULL, *lladdr = NULL;
+
+	if (h->nlmsg_type != RTM_NEWNEIGH || nd->ndm_ifindex != ring.ifindex ||
+	    !(nd->ndm_state & NUD_USABLE))
+		return 0;
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == NDA_DST &&
+		    RTA_PAYLOAD(rta) == (nd->ndm_family == AF_INET ? 4 : 16))
+			dst = RTA_DATA(rta);
+		if (rta->rta_type == NDA_LLADDR && RTA_PAYLOAD(rta) == ETH_ALEN)
+			lladdr = RTA_DATA(rta);
+	}
+	if (!dst || !lladdr)
+		return 0;
+
+	if ((ring.nhops & (ring.nhops - 1)) == 0) {
+		n = realloc(ring.hops, (ring.nhops ? ring.nhops * 2 : 1) * sizeof(*n));
+		if (!n) {
+			fprintf(stderr, "Failed realloc() for %lu neighbors\n", ring.nhops);
+			return -1;
+		}
+		ring.hops = n;
+	}
+	n = &ring.hops[ring.nhops];
+	n->family = nd->ndm_family;
+	memcpy(n->addr, dst, nd->ndm_family == AF_INET ? 4 : 16);
+	memcpy(n->mac, lladdr, ETH_ALEN);
+	return hop_insert(arg, n->family, n->addr, ring.nhops++);
+}
+
+struct route_reply {
+	int found;
+	int oif;
+	int via;		/* a gateway of the other family */
+	void *gw;
+	uint8_t gw_addr[16];
+};
+
+static int parse_route(struct nlmsghdr *h, void *arg)
+{
+	struct rtmsg *rt = NLMSG_DATA(h);
+	struct rtattr *rta = RTM_RTA(rt);
+	int len = RTM_PAYLOAD(h);
+	struct route_reply *r = arg;
+
+	if (h->nlmsg_type != RTM_NEWROUTE || rt->rtm_type != RTN_UNICAST)
+		return 0;
+	r->found = 1;
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == RTA_OIF && RTA_PAYLOAD(rta) == sizeof(int))
+			memcpy(&r->oif, RTA_DATA(rta), sizeof(int));
+		if (rta->rta_type == RTA_GATEWAY &&
+		    RTA_PAYLOAD(rta) == (rt->rtm_family == AF_INET ? 4 : 16)) {
+			memcpy(r->gw_addr, RTA_DATA(rta), RTA_PAYLOAD(rta));
+			r->gw = r->gw_addr;
+		}
+		if (rta->rta_type == RTA_VIA)
+			r->via = 1;
+	}
+	return 0;
+}
+
+static int route_hop(int nl, const tickle_template *t, const struct hop_table *neigh)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct rtmsg rt;
+		char attrs[64];
+	} req;
+	struct route_reply r = { 0 };
+	struct hop_slot *sl;
+	size_t n = t->family == AF_INET ? 4 : 16;
+	uint16_t port;
+	const void *peer = template_peer(t, &port);
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rt));
+	req.nlh.nlmsg_type = RTM_GETROUTE;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST;
+	req.rt.rtm_family = t->family;
+	req.rt.rtm_dst_len = n * 8;
+	add_rtattr(&req.nlh, RTA_DST, peer, n);
+	if (t->family == AF_INET6 && t->dst.ip6.sin6_scope_id) {
+		int oif = t->dst.ip6.sin6_scope_id;
+		add_rtattr(&req.nlh, RTA_OIF, &oif, sizeof(oif));
+	}
+
+	/* no route is no error, the raw socket reports it */
+	if (rtnl_talk(nl, &req.nlh, parse_route, &r) || !r.found || r.via ||
+	    r.oif != ring.ifindex)
+		return -1;
+	sl = hop_slot(neigh, t->family, r.gw ? r.gw : peer);
+	return sl->family ? sl->hop : -1;
+}
+
+static int resolve_hops(struct tickle_run *run, const char *ifname)
+{
+	struct hop_table neigh = { 0 }, peers = { 0 };
+	struct {
+		struct nlmsghdr nlh;
+		struct ndmsg nd;
+	} req;
+	static const int families[] = { AF_INET, AF_INET6 };
+	unsigned long c, ringed = 0;
+	unsigned int f;
+	int nl, ret = -1;
+
+	nl = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (nl == -1) {
+		fprintf(stderr, "Failed to open rtnetlink socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	if (hop_table_init(&neigh, 256) || hop_table_init(&peers, 1024))
+		goto out;
+
+	for (f = 0; f < sizeof(families) / sizeof(families[0]); f++) {
+		memset(&req, 0, sizeof(req));
+		req.nlh.nlmsg_len = sizeof(req);
+		req.nlh.nlmsg_type = RTM_GETNEIGH;
+		req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+		req.nd.ndm_family = families[f];
+		if (rtnl_talk(nl, &req.nlh, add_neighbor, &neigh)) {
+			fprintf(stderr, "Failed to dump the neighbor table (%s)\n", strerror(errno));
+			goto out;
+		}
+	}
+
+	for (c = 0; c < run->nconns; c++) {
+		tickle_template *t = &run->conns[c];
+		uint16_t port;
+		const void *peer = template_peer(t, &port);
+		struct hop_slot *sl = hop_slot(&peers, t->family, peer);
+
+		if (sl->family) {
+			t->hop = sl->hop;
+		} else {
+			t->hop = route_hop(nl, t, &neigh);
+			if (hop_insert(&peers, t->family, peer, t->hop))
+				goto out;
+		}
+		if (t->hop >= 0)
+			ringed++;
+	}
+	if (run->verbose)
+		fprintf(stderr, "%lu of %lu connections go through the TX ring on %s, %lu neighbors\n",
+			ringed, run->nconns, ifname, ring.nhops);
+	ret = 0;
+out:
+	free(neigh.slot);
+	free(peers.slot);
+	close(nl);
+	return ret;
+}
+
+static int open_reply_socket(int family)
+{
+	int s, one = 1, size = 4 << 20;
+
+	s = socket(family, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (s == -1) {
+		fprintf(stderr, "Failed to open raw TCP socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (family == AF_INET6)
+		setsockopt(s, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof(one));
+	return s;
+}
+
+/*
+  With -V the replies come from an AF_PACKET capture on all interfaces
+  instead, which stamps them on arrival. A classic BPF filter passes
+  only incoming TCP segments with ACK or RST, and only those to our own
+  end of the connections when there are at most FILTER_ADDRS such
+  addresses per family. The exact tuple is then looked up with
+  find_connection().
+*/
+#define FILTER_ADDRS 16
+#define FILTER_SNAP 128		/* IP and TCP headers, with options */
+#define FILTER_INSNS (40 + FILTER_ADDRS * 9)
+
+enum { L_FALL = -1, L_DROP, L_ACCEPT, L_TCP4, L_V6, L_TCP6, L_ADDR6 };
+
+struct filter_asm {
+	struct sock_filter insn[FILTER_INSNS];
+	int jt[FILTER_INSNS], jf[FILTER_INSNS];		/* labels */
+	int label[L_ADDR6 + FILTER_ADDRS + 1];
+	unsigned int n;
+};
+
+static void emit(struct filter_asm *a, uint16_t code, uint32_t k, int jt, int jf)
+{
+	a->insn[a->n].code = code;
+	a->insn[a->n].k = k;
+	a->jt[a->n] = jt;
+	a->jf[a->n] = jf;
+	a->n++;
+}
+
+static void mark(struct filter_asm *a, int label)
+{
+	a->label[label] = a->n;
+}
+
+/*
+  Turn the labels into offsets. An unconditional jump takes its label
+  as jt.
+*/
+static void resolve_labels(struct filter_asm *a)
+{
+	unsigned int i;
+
+	for (i = 0; i < a->n; i++) {
+		struct sock_filter *f = &a->insn[i];
+
+		if (f->code == (BPF_JMP | BPF_JA)) {
+			f->k = a->label[a->jt[i]] - i - 1;
+			continue;
+		}
+		f->jt = a->jt[i] == L_FALL ? 0 : a->label[a->jt[i]] - i - 1;
+		f->jf = a->jf[i] == L_FALL ? 0 : a->label[a->jf[i]] - i - 1;
+	}
+}
+
+/*
+  Our own addresses of the connections, up to FILTER_ADDRS per family.
+  Returns the number found, or -1 if there are more.
+*/
+static int own_addrs(const struct tickle_run *run, int family, uint8_t addrs[][16])
+{
+	size_t len = family == AF_INET ? 4 : 16;
+	unsigned long c;
+	int n = 0, i;
+
+	for (c = 0; c < run->nconns; c++) {
+		uint16_t port;
+		const void *self;
+
+		if (run->conns[c].family != family)
+			continue;
+		self = template_self(&run->conns[c], &port);
+		for (i = 0; i < n && memcmp(addrs[i], self, len); i++)
+			;
+		if (i < n)
+			continue;
+		if (n == FILTER_ADDRS)
+			return -1;
+		memcpy(addrs[n++], self, len);
+	}
+	return n;
+}
+
+static void build_filter(struct filter_asm *a, const struct tickle_run *run)
+{
+	uint8_t v4[FILTER_ADDRS][16], v6[FILTER_ADDRS][16];
+	int n4 = own_addrs(run, AF_INET, v4), n6 = own_addrs(run, AF_INET6, v6);
+	int i, w;
+	uint32_t word;
+
+	a->n = 0;
+	emit(a, BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE, L_FALL, L_FALL);
+	emit(a, BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, L_DROP, L_FALL);
+	emit(a, BPF_LD | BPF_B | BPF_ABS, 0, L_FALL, L_FALL);
+	emit(a, BPF_ALU | BPF_AND | BPF_K, 0xf0, L_FALL, L_FALL);
+	emit(a, BPF_JMP | BPF_JEQ | BPF_K, 0x40, L_FALL, L_V6);
+
+	/* IPv4: TCP, not a fragment, to one of our addresses */
+	emit(a, BPF_LD | BPF_B | BPF_ABS, 9, L_FALL, L_FALL);
+	emit(a, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, L_FALL, L_DROP);
+	emit(a, BPF_LD | BPF_H | BPF_ABS, 6, L_FALL, L_FALL);
+	emit(a, BPF_JMP | BPF_JSET | BPF_K, 0x1fff, L_DROP, L_FALL);
+	if (n4 >= 0) {
+		emit(a, BPF_LD | BPF_W | BPF_ABS, 16, L_FALL, L_FALL);
+		for (i = 0; i < n4; i++) {
+			memcpy(&word, v4[i], 4);
+			emit(a, BPF_JMP | BPF_JEQ | BPF_K, ntohl(word), L_TCP4, L_FALL);
+		}
+		emit(a, BPF_JMP | BPF_JA, 0, L_DROP, L_FALL);
+	}
+	mark(a, L_TCP4);
+	emit(a, BPF_LDX | BPF_B | BPF_MSH, 0, L_FALL, L_FALL);
+	emit(a, BPF_LD | BPF_B | BPF_IND, 13, L_FALL, L_FALL);
+	emit(a, BPF_JMP | BPF_JSET | BPF_K, 0x14, L_ACCEPT, L_DROP);	/* ACK or RST */
+
+	/* IPv6: TCP right after the fixed header, to one of our addresses */
+	mark(a, L_V6);
+	emit(a, BPF_JMP | BPF_JEQ | BPF_K, 0x60, L_FALL, L_DROP);
+	emit(a, BPF_LD | BPF_B | BPF_ABS, 6, L_FALL, L_FALL);
+	emit(a, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, L_FALL, L_DROP);
+	if (n6 >= 0) {
+		for (i = 0; i < n6; i++) {
+			mark(a, L_ADDR6 + i);
+			for (w = 0; w < 4; w++) {
+				memcpy(&word, v6[i] + w * 4, 4);
+				emit(a, BPF_LD | BPF_W | BPF_ABS, 24 + w * 4, L_FALL, L_FALL);
+				emit(a, BPF_JMP | BPF_JEQ | BPF_K, ntohl(word),
+				     w == 3 ? L_TCP6 : L_FALL, L_ADDR6 + i + 1);
+			}
+		}
+		mark(a, L_ADDR6 + n6);
+		emit(a, BPF_JMP | BPF_JA, 0, L_DROP, L_FALL);
+	}
+	mark(a, L_TCP6);
+	emit(a, BPF_LD | BPF_B | BPF_ABS, 40 + 13, L_FALL, L_FALL);
+	emit(a, BPF_JMP | BPF_JSET | BPF_K, 0x14, L_ACCEPT, L_DROP);	/* ACK or RST */
+
+	mark(a, L_ACCEPT);
+	emit(a, BPF_RET | BPF_K, FILTER_SNAP, L_FALL, L_FALL);
+	mark(a, L_DROP);
+	emit(a, BPF_RET | BPF_K, 0, L_FALL, L_FALL);
+	resolve_labels(a);
+}
+
+static int open_capture(const struct tickle_run *run)
+{
+	static struct filter_asm a;
+	struct sock_fprog prog;
+	struct sockaddr_ll sll;
+	int s, one = 1, size = 16 << 20;
+
+	build_filter(&a, run);
+	prog.len = a.n;
+	prog.filter = a.insn;
+
+	/* protocol 0 until the filter is in place: nothing is received */
+	s = socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (s == -1) {
+		fprintf(stderr, "Failed to open packet socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) ||
+	    setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one))) {
+		fprintf(stderr, "Failed to set up the capture (%s)\n", strerror(errno));
+		close(s);
+		return -1;
+	}
+	if (setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	if (bind(s, (struct sockaddr *)&sll, sizeof(sll))) {
+		fprintf(stderr, "Failed to bind the capture (%s)\n", strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+static uint64_t realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void count_response(struct tickle_run *run, long c,
+			   const struct tcphdr *tcp, uint64_t ts_ns)
+{
+	struct verify_conn *v = &run->vc[c];
+
+	if (v->responses == 0) {
+		v->rst = tcp->rst;
+		v->latency_us = ts_ns > v->sent_ns ? (ts_ns - v->sent_ns) / 1000 : 0;
+	}
+	if (v->responses < UINT16_MAX)
+		v->responses++;
+}
+
+/*
+  A tickle ACK is out of window, so the peer answers it with an ACK
+  carrying its own snd_nxt and rcv_nxt. A RST with rcv_nxt as sequence
+  number lands exactly in window (RFC 5961), which no number known on
+  this node would: the sockets do not exist here, and tcp_info does not
+  expose sequence numbers anyway. A RST from the peer ends the
+  connection just as well.
+*/
+static void handle_reply(struct tickle_run *run, int family,
+			 const void *peer, const void *self,
+			 const struct tcphdr *tcp, uint64_t ts_ns)
+{
+	long c;
+
+	if (!tcp->ack && !tcp->rst)
+		return;
+	c = find_connection(run, family, peer, tcp->source, self, tcp->dest);
+	if (c < 0)
+		return;
+	if (run->verify)
+		count_response(run, c, tcp, ts_ns);
+	if (run->done[c])
+		return;
+	run->done[c] = 1;
+	run->replied++;
+	if (run->reset) {
+		run->resets++;
+		if (!tcp->rst)
+			queue_tickle(&run->conns[c], tcp->ack_seq, tcp->seq, 1);
+	}
+}
+
+static void collect_replies(struct tickle_run *run)
+{
+	static uint8_t buf[2048];
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+		char ts[CMSG_SPACE(sizeof(struct timespec))];
+	} control;
+
+	while (run->cap4 != -1) {
+		ssize_t len = recv(run->cap4, buf, sizeof(buf), 0);
+		const struct iphdr *ip = (const struct iphdr *)buf;
+
+		if (len == -1)
+			break;
+		if (len < (ssize_t)sizeof(*ip) ||
+		    len < ip->ihl * 4 + (ssize_t)sizeof(struct tcphdr))
+			continue;
+		handle_reply(run, AF_INET, &ip->saddr, &ip->daddr,
+			     (const struct tcphdr *)(buf + ip->ihl * 4), 0);
+	}
+	while (run->cap6 != -1) {
+		struct sockaddr_in6 from;
+		struct iovec iov = { buf, sizeof(buf) };
+		struct msghdr msg = {
+			.msg_name = &from, .msg_namelen = sizeof(from),
+			.msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = &control, .msg_controllen = sizeof(control),
+		};
+		struct cmsghdr *cm;
+		const void *self = NULL;
+		ssize_t len = recvmsg(run->cap6, &msg, 0);
+
+		if (len == -1)
+			break;
+		if (len < (ssize_t)sizeof(struct tcphdr))
+			continue;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+			if (cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_PKTINFO)
+				self = &((struct in6_pktinfo *)CMSG_DATA(cm))->ipi6_addr;
+		handle_reply(run, AF_INET6, &from.sin6_addr, self,
+			     (const struct tcphdr *)buf, 0);
+	}
+	while (run->capture != -1) {
+		struct sockaddr_ll from;
+		struct iovec iov = { buf, sizeof(buf) };
+		struct msghdr msg = {
+			.msg_name = &from, .msg_namelen = sizeof(from),
+			.msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = &control, .msg_controllen = sizeof(control),
+		};
+		struct cmsghdr *cm;
+		const struct iphdr *ip = (const struct iphdr *)buf;
+		uint64_t ts_ns = 0;
+		ssize_t len = recvmsg(run->capture, &msg, 0);
+
+		if (len == -1)
+			break;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+				struct timespec ts;
+
+				memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+				ts_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+			}
+		if (!ts_ns)
+			ts_ns = realtime_ns();
+		if (from.sll_protocol == htons(ETH_P_IP) &&
+		    len >= (ssize_t)sizeof(*ip) &&
+		    len >= ip->ihl * 4 + (ssize_t)sizeof(struct tcphdr))
+			handle_reply(run, AF_INET, &ip->saddr, &ip->daddr,
+				     (const struct tcphdr *)(buf + ip->ihl * 4), ts_ns);
+		else if (from.sll_protocol == htons(ETH_P_IPV6) &&
+			 len >= (ssize_t)(sizeof(struct ip6_hdr) + sizeof(struct tcphdr)))
+			handle_reply(run, AF_INET6, buf + 8, buf + 24,
+				     (const struct tcphdr *)(buf + sizeof(struct ip6_hdr)), ts_ns);
+	}
+	flush_tickle_acks();
+}
+
+/*
+  Prepare -k or -V: index the connections, and open the capture or a
+  receiving socket for each family among them.
+*/
+static int start_replies(struct tickle_run *run)
+{
+	unsigned long c;
+	int want4 = 0, want6 = 0;
+
+	for (c = 0; c < run->nconns; c++) {
+		if (run->conns[c].family == AF_INET)
+			want4 = 1;
+		else
+			want6 = 1;
+	}
+	if (index_connections(run))
+		return -1;
+	if (run->verify) {
+		run->vc = calloc(run->nconns ? run->nconns : 1, sizeof(*run->vc));
+		if (!run->vc) {
+			fprintf(stderr, "Failed calloc() for %lu connections\n", run->nconns);
+			return -1;
+		}
+		run->capture = open_capture(run);
+		return run->capture == -1 ? -1 : 0;
+	}
+	if (want4 && (run->cap4 = open_reply_socket(AF_INET)) == -1)
+		return -1;
+	if (want6 && (run->cap6 = open_reply_socket(AF_INET6)) == -1)
+		return -1;
+	return 0;
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+  The -V summary: how many connections answered and how, in which
+  round, and the latency percentiles of the first responses.
+*/
+static void print_verify_summary(const struct tickle_run *run)
+{
+	unsigned long answered = 0, rsts = 0, responses = 0, c;
+	unsigned long per_round[MAX_ROUNDS + 1] = { 0 };
+	uint32_t *lat = malloc((run->nconns ? run->nconns : 1) * sizeof(*lat));
+	struct tpacket_stats st;
+	socklen_t len = sizeof(st);
+	unsigned int r;
+
+	for (c = 0; c < run->nconns; c++) {
+		const struct verify_conn *v = &run->vc[c];
+
+		if (!v->responses)
+			continue;
+		if (lat)
+			lat[answered] = v->latency_us;
+		answered++;
+		rsts += v->rst;
+		responses += v->responses;
+		per_round[v->round]++;
+	}
+	printf("%lu of %lu connections answered, %lu with an ACK and %lu with a RST, %lu responses\n",
+	       answered, run->nconns, answered - rsts, rsts, responses);
+	printf("answered in round");
+	for (r = 1; r <= run->rounds; r++)
+		printf(" %u: %lu%s", r, per_round[r], r < run->rounds ? "," : "\n");
+	if (lat && answered) {
+		qsort(lat, answered, sizeof(*lat), cmp_uint32);
+		printf("latency min %u us, p50 %u us, p90 %u us, p99 %u us, max %u us\n",
+		       lat[0], lat[(answered * 50 + 99) / 100 - 1],
+		       lat[(answered * 90 + 99) / 100 - 1],
+		       lat[(answered * 99 + 99) / 100 - 1], lat[answered - 1]);
+	}
+	if (getsockopt(run->capture, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0 &&
+	    st.tp_drops)
+		printf("%u packets dropped by the capture\n", st.tp_drops);
+	free(lat);
+}
+
+/*
+  After the last round, wait up to REPLY_WAIT_MS for the remaining
+  replies.
+*/
+#define REPLY_WAIT_MS 1000
+
+static void finish_replies(struct tickle_run *run)
+{
+	struct pollfd pfd[3] = {
+		{ .fd = run->cap4, .events = POLLIN },
+		{ .fd = run->cap6, .events = POLLIN },
+		{ .fd = run->capture, .events = POLLIN },
+	};
+	struct timespec end, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ts_add_ns(&end, REPLY_WAIT_MS * 1000000LL);
+	while (run->replied < run->nconns) {
+		long long left;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = ts_diff_ns(&now, &end) / 1000000;
+		if (left <= 0)
+			break;
+		if (poll(pfd, 3, left) > 0)
+			collect_replies(run);
+	}
+	if (run->reset && run->verbose)
+		fprintf(stderr, "%lu of %lu connections reset\n", run->resets, run->nconns);
+	if (run->verify)
+		print_verify_summary(run);
+	if (run->cap4 != -1)
+		close(run->cap4);
+	if (run->cap6 != -1)
+		close(run->cap6);
+	if (run->capture != -1)
+		close(run->capture);
+}
+/*
+  Tickle every connection num times per round. With a rate, packets go
+  out in bursts of run->burst, each burst due burst/rate seconds after
+  the one before, so that the average rate is kept however long a
+  round takes. A round that is due while the previous one still runs
+  starts right after it. Fails only if no raw socket can be opened.
+*/
+static int send_rounds(struct tickle_run *run)
+{
+	struct timespec start, due, now, report;
+	unsigned int r;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (r = 0; r < run->rounds; r++) {
+		unsigned long total = run->nconns * run->num, done = 0;
+		unsigned long sent = queue.sent, dropped = queue.dropped;
+		unsigned long credit = 0, c;
+		struct timespec round_start;
+		int i;
+
+		/* nothing left to tickle again */
+		if (run->replies && run->replied == run->nconns)
+			break;
+		due = start;
+		ts_add_ns(&due, run->offset_ms[r] * 1000000LL);
+		sleep_until(&due);
+		clock_gettime(CLOCK_MONOTONIC, &round_start);
+		due = report = round_start;
+		ts_add_ns(&report, 1000000000LL);
+
+		for (c = 0; c < run->nconns; c++) {
+			if (run->replies && run->done[c])
+				continue;
+			for (i = 0; i < run->num; i++) {
+				if (run->rate && credit == 0) {
+					flush_tickle_acks();
+					if (run->replies)
+						collect_replies(run);
+					sleep_until(&due);
+					ts_add_ns(&due, run->burst * 1000000000LL / run->rate);
+					credit = run->burst;
+				}
+				if (run->verify && i == 0) {
+					run->vc[c].sent_ns = realtime_ns();
+					run->vc[c].round = r + 1;
+				}
+				if (queue_tickle(&run->conns[c], 0, 0, 0))
+					return -1;
+				credit--;
+				done++;
+			}
+			if (run->replies && (c & 63) == 0)
+				collect_replies(run);
+			if (run->verbose && (c & 255) == 0) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if (ts_diff_ns(&report, &now) >= 0) {
+					fprintf(stderr, "round %u: %lu of %lu packets, %lu dropped\n",
+						r + 1, done, total, queue.dropped - dropped);
+					report = now;
+					ts_add_ns(&report, 1000000000LL);
+				}
+			}
+		}
+		flush_tickle_acks();
+		if (run->replies)
+			collect_replies(run);
+
+		if (run->verbose) {
+			double secs;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			secs = ts_diff_ns(&round_start, &now) / 1e9;
+			fprintf(stderr, "round %u at +%lld ms: %lu packets sent in %.3f s (%.0f packets/s), %lu dropped\n",
+				r + 1, ts_diff_ns(&start, &round_start) / 1000000,
+				queue.sent - sent, secs,
+				secs > 0 ? (queue.sent - sent) / secs : 0,
+				queue.dropped - dropped);
+		}
+	}
+	return 0;
+}
+
+/*
+  Connections are read in chunks of INPUT_CHUNK and parsed in place,
+  as lines of "local_ip:port remote_ip:port", or as binary records when
+  the input starts with STATE_MAGIC. Blank lines are skipped, anything
+  after the second address on a line is ignored.
+*/
+#define INPUT_CHUNK 65536
+
+static struct {
+	char buf[INPUT_CHUNK];
+	size_t start, end;
+	int eof;
+} input;
+
+static int fill_input(int fd)
+{
+	ssize_t n;
+
+	if (input.start) {
+		memmove(input.buf, input.buf + input.start, input.end - input.start);
+		input.end -= input.start;
+		input.start = 0;
+	}
+	while (!input.eof && input.end < sizeof(input.buf)) {
+		n = read(fd, input.buf + input.end, sizeof(input.buf) - input.end);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			fprintf(stderr, "Failed to read the connections (%s)\n", strerror(errno));
+			return -1;
+		}
+		if (n == 0)
+			input.eof = 1;
+		input.end += n;
+		break;
+	}
+	return 0;
+}
+
+static int parse_line(const char *line, size_t len, struct tickle_run *run)
+{
+	const char *end = line + len, *tok[2], *p = line;
+	size_t toklen[2];
+	sock_addr src, dst;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+			p++;
+		tok[i] = p;
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+			p++;
+		toklen[i] = p - tok[i];
+		if (toklen[i] == 0)
+			break;
+	}
+	if (i == 0 && toklen[0] == 0)
+		return 0;
+
+	if (toklen[0] == 0 || parse_ip_port_n(tok[0], toklen[0], &src)) {
+		fprintf(stderr, "Bad IP:port '%.*s'\n", (int)toklen[0], tok[0]);
+		return -1;
+	}
+	if (toklen[1] == 0 || parse_ip_port_n(tok[1], toklen[1], &dst)) {
+		fprintf(stderr, "Bad IP:port '%.*s'\n", (int)toklen[1], tok[1]);
+		return -1;
+	}
+	return add_connection(&src, &dst, NULL, run);
+}
+
+static int read_connections(int fd, struct tickle_run *run)
+{
+	int binary;
+
+	do {
+		if (fill_input(fd))
+			return -1;
+	} while (!input.eof && input.end < sizeof(STATE_MAGIC) - 1);
+	binary = input.end >= sizeof(STATE_MAGIC) - 1 &&
+		!memcmp(input.buf, STATE_MAGIC, sizeof(STATE_MAGIC) - 1);
+	if (binary)
+		input.start = sizeof(STATE_MAGIC) - 1;
+
+	while (input.start < input.end || !input.eof) {
+		const char *p = input.buf + input.start;
+		size_t avail = input.end - input.start, len;
+
+		if (binary) {
+			len = avail ? (*p == 4 ? RECORD4_LEN : RECORD6_LEN) : 1;
+			if (avail && *p != 4 && *p != 6) {
+				fprintf(stderr, "Bad record type %d\n", *p);
+				return -1;
+			}
+		} else {
+			const char *nl = memchr(p, '\n', avail);
+
+			len = nl ? (size_t)(nl - p) + 1 : avail + 1;
+		}
+
+		if (len > avail) {
+			if (input.eof && binary) {
+				fprintf(stderr, "Truncated record at the end of the input\n");
+				return -1;
+			}
+			if (input.eof) {
+				/* last line without a newline */
+				input.start = input.end;
+				if (parse_line(p, avail, run))
+					return -1;
+				continue;
+			}
+			if (input.start == 0 && input.end == sizeof(input.buf)) {
+				fprintf(stderr, "Input line too long\n");
+				return -1;
+			}
+			if (fill_input(fd))
+				return -1;
+			continue;
+		}
+
+		input.start += len;
+		if (binary) {
+			sock_addr local, remote;
+
+			parse_record((const uint8_t *)p, &local, &remote);
+			if (add_connection(&local, &remote, NULL, run))
+				return -1;
+		} else if (parse_line(p, len - 1, run)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+  The state file is replaced only once complete and on disk, so that a
+  failover never finds it truncated.
+*/
+static FILE *open_state_file(const char *path, char *tmp, size_t len)
+{
+	FILE *f;
+
+	snprintf(tmp, len, "%s.new", path);
+	f = fopen(tmp, "w");
+	if (!f)
+		fprintf(stderr, "Failed to open %s (%s)\n", tmp, strerror(errno));
+	return f;
+}
+
+static int close_state_file(FILE *f, const char *tmp, const char *path)
+{
+	if (fflush(f) || fsync(fileno(f)) || fclose(f)) {
+		fprintf(stderr, "Failed to write %s (%s)\n", tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	if (rename(tmp, path)) {
+		fprintf(stderr, "Failed to rename %s to %s (%s)\n", tmp, path, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(void)
+{
+	printf("Usage: /usr/lib/heartbeat/tickle_tcp [ -n num ] [ -r pps [ -B burst ] ] [ -T times ] [ -i if ] [ -s ] [ -k ] [ -V ] [ -v ]\n");
+	printf("       /usr/lib/heartbeat/tickle_tcp -a ip [ -p ports ] [ -w file ] [ -d ] [ options as above ]\n");
+	printf("Please note that without -a this program need to read the list of\n");
+	printf("{local_ip:port remote_ip:port} from stdin, IPv6 as [addr%%scope]:port,\n");
+	printf("or a binary file as written with -F.\n");
+	printf("  -n num    send num tickle ACKs per connection and round, 0 sends none\n");
+	printf("  -r pps    send at most pps packets per second\n");
+	printf("  -B burst  with -r, send burst packets back to back (default 64)\n");
+	printf("  -T times  tickle again at these times in ms, e.g. 0,100,1000\n");
+	printf("  -i if     send through a TX ring on Ethernet interface if to the\n");
+	printf("            peers whose next hop on it is in the neighbor table\n");
+	printf("  -s        tickle the local end of each connection instead\n");
+	printf("  -a ip     tickle the established connections on local address ip,\n");
+	printf("            as found in the kernel, instead of reading stdin\n");
+	printf("  -p ports  with -a, only those on these local ports, e.g. 80,443,8000:8080\n");
+	printf("  -w file   also write the connections to file, in the format read\n");
+	printf("            from stdin\n");
+	printf("  -F        with -w, write a binary file, which is read back faster\n");
+	printf("  -d        with -a, close the local sockets through SOCK_DESTROY, the\n");
+	printf("            kernel resets the peers; tickle those it cannot close\n");
+	printf("  -k        reset each connection from the peer's reply to the tickle,\n");
+	printf("            with an in-window sequence number\n");
+	printf("  -V        capture the peers' replies, tickle again only those that\n");
+	printf("            did not answer, by default at 0,200,1000 ms, and print a\n");
+	printf("            summary; fail unless all answered\n");
+	printf("  -v        report the number of packets sent and the rate\n");
+	printf("  -b num    time building num packets with and without templates,\n");
+	printf("            nothing is read or sent\n");
+	exit(1);
+}
+
+/* the rounds of -V without -T */
+#define VERIFY_SCHEDULE "0,200,1000"
+
+#define OPTION_STRING "n:r:B:T:i:sa:p:w:FdkVvb:h"
+
+int main(int argc, char *argv[])
+{
+	int optchar, cont = 1;
+	struct tickle_run run = { .num = 1, .burst = TICKLE_BATCH, .rounds = 1,
+				  .destroy_nl = -1, .cap4 = -1, .cap6 = -1,
+				  .capture = -1 };
+	int destroy = 0, schedule = 0;
+	struct timespec start, end;
+	double secs;
+	sock_addr ip;
+	const char *discover = NULL, *state_path = NULL, *ifname = NULL;
+	char state_tmp[PATH_MAX];
+
+	while(cont) {
+		optchar = getopt(argc, argv, OPTION_STRING);
+		switch(optchar) {
+		case 'n':
+			run.num = atoi(optarg);
+			break;
+		case 'r':
+			run.rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'B':
+			run.burst = strtoul(optarg, NULL, 10);
+			if (run.burst == 0) {
+				fprintf(stderr, "Bad burst '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'T':
+			if (parse_schedule(&run, optarg))
+				exit(EXIT_FAILURE);
+			schedule = 1;
+			break;
+		case 'i':
+			ifname = optarg;
+			break;
+		case 's':
+			run.swap = 1;
+			break;
+		case 'a':
+			discover = optarg;
+			break;
+		case 'p':
+			if (parse_port_list(optarg))
+				exit(EXIT_FAILURE);
+			break;
+		case 'w':
+			state_path = optarg;
+			break;
+		case 'F':
+			run.binary = 1;
+			break;
+		case 'd':
+			destroy = 1;
+			break;
+		case 'k':
+			run.reset = 1;
+			break;
+		case 'V':
+			run.verify = 1;
+			break;
+		case 'v':
+			run.verbose = 1;
+			break;
+		case 'b':
+			run_benchmark(atol(optarg) > 0 ? atol(optarg) : 1);
+			exit(EXIT_SUCCESS);
+			break;
+		case 'h':
+			usage();
+			exit(EXIT_SUCCESS);
+			break;
+		case EOF:
+			cont = 0;
+			break;
+		default:
+			fprintf(stderr, "unknown option, please use '-h' for usage.\n");
+			exit(EXIT_FAILURE);
+			break;
+		};
+	}
+
+	if ((port_filter || destroy) && !discover) {
+		fprintf(stderr, "-p and -d need -a, please use '-h' for usage.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (run.binary && !state_path) {
+		fprintf(stderr, "-F needs -w, please use '-h' for usage.\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((run.reset || run.verify) && run.num <= 0) {
+		fprintf(stderr, "-k and -V need tickles to be sent, please use '-h' for usage.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (run.verify && !schedule)
+		parse_schedule(&run, VERIFY_SCHEDULE);
+	run.replies = run.reset || run.verify;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (state_path &&
+	    !(run.state = open_state_file(state_path, state_tmp, sizeof(state_tmp))))
+		return -1;
+	if (run.state && run.binary)
+		fputs(STATE_MAGIC, run.state);
+	if (discover) {
+		if (parse_ip(discover, NULL, 0, &ip)) {
+			fprintf(stderr, "Bad IP '%s'\n", discover);
+			return -1;
+		}
+		if (destroy) {
+			run.destroy_nl = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+						NETLINK_SOCK_DIAG);
+			if (run.destroy_nl == -1) {
+				fprintf(stderr, "Failed to open sock_diag socket (%s)\n", strerror(errno));
+				return -1;
+			}
+		}
+		if (discover_connections(&ip, add_connection, &run)) {
+			if (run.state)
+				unlink(state_tmp);
+			return -1;
+		}
+		if (destroy) {
+			close(run.destroy_nl);
+			if (run.verbose)
+				fprintf(stderr, "%lu sockets destroyed\n", run.destroyed);
+		}
+	} else if (read_connections(STDIN_FILENO, &run)) {
+		if (run.state)
+			unlink(state_tmp);
+		return -1;
+	}
+	if (run.state && close_state_file(run.state, state_tmp, state_path))
+		return -1;
+
+	if (ifname && run.num > 0 &&
+	    (open_tx_ring(ifname) || resolve_hops(&run, ifname)))
+		return -1;
+	if (run.replies && start_replies(&run))
+		return -1;
+	if (run.num > 0 && send_rounds(&run))
+		return -1;
+	if (run.replies)
+		finish_replies(&run);
+	close_tickle_sockets();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (run.verbose) {
+		secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		fprintf(stderr, "%lu connections, %lu packets sent in %.3f s (%.0f packets/s), %lu dropped\n",
+			run.nconns, queue.sent, secs, secs > 0 ? queue.sent / secs : 0,
+			queue.dropped);
+	}
+	if (queue.dropped) {
+		fprintf(stderr, "Error while sending tickle acks, %lu packets dropped\n",
+			queue.dropped);
+		return -1;
+	}
+	if (run.verify && run.replied < run.nconns)
+		return -1;
 	return 0;
 }